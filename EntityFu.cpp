@@ -6,6 +6,29 @@
 
 #include "EntityFu.h"
 #include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+#endif
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
 using namespace std;
 
 /// Turn this on to have a faster yet riskier ECS.
@@ -30,254 +53,3293 @@ using namespace std;
 #endif
 #endif
 
-/// Turn this to 1 or 2 to debug the ECS.
-/// 1 == log creation, 2 == also log deletion, 3 == also log component add/remove, 4 == also log component totals.
-static int verbosity = 0;
+/// Turn this to 1 to debug the ECS.
+/// 1 == log allocation, snapshots and batch operations.
+/// Individual creations, destructions and component changes are recorded with `Entity::trace` instead.
+/// Each world starts with this verbosity.
+static int defaultVerbosity = 0;
+
+/// The component array of every pool which has never had a component, shared by all worlds.
+/// It is only ever read, so its pages are never backed by memory.
+static Entity::Component* blankComponents[Entity::kMaxEntities];
 
-/// Static pointers to the ECS data.
-static bool* entities = nullptr;
-static Entity::Component*** components = nullptr;
-static vector<Eid>* componentEids = nullptr;
+/// Descriptions of each component class, shared by all worlds.
+static vector<Entity::Type> types;
 
-static void log(Cid cid)
+/// Count the set bits of a word.
+static inline unsigned popcount(uint64_t x)
 {
-	auto n = Entity::count(cid);
-	auto& eids = Entity::getAll(cid);
-	if (eids.size() > 0)
-		LogV(verbosity, 4, "  Cid %u has %d entities ranging from %u to %u", cid, n, eids.front(), eids.back());
+#ifdef _MSC_VER
+	return (unsigned)__popcnt64(x);
+#else
+	return (unsigned)__builtin_popcountll(x);
+#endif
 }
 
-void Entity::alloc()
+/// Heap allocations made on this thread, see `Entity::allocations`.
+static thread_local uint64_t allocationCount = 0;
+
+/// Turn this to 1 in a debug or benchmark build to count every heap allocation on the thread through
+/// a replacement global `operator new`, including those of standard containers and of your own code.
+/// Leave it at 0 if your program replaces `operator new` itself; only the ECS's own allocations are counted then.
+#ifndef EntityFu_CountAllocations
+	#define EntityFu_CountAllocations 0
+#endif
+
+/// Count an allocation made by the ECS itself. The global hook, when on, has counted it already.
+static inline void countAllocation(unsigned n = 1)
 {
-	if (components != nullptr)
-		return;
-	LogV(verbosity, 1, "Allocing entities");
+#if !EntityFu_CountAllocations
+	allocationCount += n;
+#endif
+}
 
-	// allocate entities
-	entities = new bool[kMaxEntities];
-	for (Eid eid = 0; eid < kMaxEntities; ++eid)
-		entities[eid] = false;
+/// Push onto a vector, counting the allocation when it has to grow.
+template<class T> static inline void pushCounted(vector<T>& v, const T& value)
+{
+	if (v.size() == v.capacity())
+		countAllocation();
+	v.push_back(value);
+}
 
-	// allocate components
-	auto max = Component::numCids;
-	components = new Component**[max];
-	componentEids = new vector<Eid>[Component::numCids];
-	for (Cid cid = 0; cid < max; cid++)
+#if EntityFu_CountAllocations
+static void* countedAllocate(size_t size)
+{
+	allocationCount++;
+	for (;;)
 	{
-		// allocate component array
-		components[cid] = new Component*[kMaxEntities];
-		
-		// zero component pointers
-		for (Eid eid = 0; eid < kMaxEntities; eid++)
-			components[cid][eid] = nullptr;
+		auto p = malloc(size > 0 ? size : 1);
+		if (p != nullptr)
+			return p;
+		auto handler = get_new_handler();
+		if (handler == nullptr)
+			throw bad_alloc();
+		handler();
 	}
 }
 
-void Entity::dealloc()
+void* operator new(size_t size) {return countedAllocate(size);}
+void* operator new[](size_t size) {return countedAllocate(size);}
+void* operator new(size_t size, const nothrow_t&) noexcept
 {
-	LogV(verbosity, 1, "Deallocing entities");
-	
-	if (components != nullptr)
+	try {return countedAllocate(size);}
+	catch (...) {return nullptr;}
+}
+void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+	try {return countedAllocate(size);}
+	catch (...) {return nullptr;}
+}
+void operator delete(void* p) noexcept {free(p);}
+void operator delete[](void* p) noexcept {free(p);}
+void operator delete(void* p, const nothrow_t&) noexcept {free(p);}
+void operator delete[](void* p, const nothrow_t&) noexcept {free(p);}
+void operator delete(void* p, size_t) noexcept {free(p);}
+void operator delete[](void* p, size_t) noexcept {free(p);}
+#endif
+
+/// Written before every component by `Component::operator new`: the arena it came from, or null,
+/// and the size class of the component pool it came from, or 0 for the heap.
+/// The arena is only compared, never followed, so components may outlive it.
+/// The alignment keeps the component after it 16-byte aligned.
+struct alignas(16) Allocation
+{
+	const Entity::Arena* arena;
+	uint32_t sizeClass;
+};
+
+static inline Allocation* allocationOf(const Entity::Component* c)
+{
+	// the header precedes the whole object, which the Component base may not start
+	return static_cast<Allocation*>(const_cast<void*>(dynamic_cast<const void*>(c))) - 1;
+}
+
+/// While a world allocates components for itself they come from its arena, whichever world is current.
+/// Anywhere else they come from the heap or the pools, since an arena is only safe on its world's thread.
+static thread_local Entity::Arena* allocatingArena = nullptr;
+
+struct AllocateFrom
+{
+	AllocateFrom(Entity::Arena* arena) : previous(allocatingArena)
 	{
-		Entity::destroyAll();
-		for (Cid cid = 0; cid < Component::numCids; cid++)
-			if (components[cid] != nullptr)
-				delete [] components[cid];
-		delete [] components;
+		allocatingArena = arena;
 	}
 
-	if (componentEids != nullptr)
-		delete [] componentEids;
+	~AllocateFrom()
+	{
+		allocatingArena = previous;
+	}
 
-	if (entities != nullptr)
-		delete [] entities;
-	
-	entities = nullptr;
-	components = nullptr;
-	componentEids = nullptr;
+	Entity::Arena* previous;
+};
+
+/// Allocate `n` default-initialized objects from an arena, or from the heap if there is none.
+template<class T> static T* newArray(Entity::Arena* arena, size_t n)
+{
+	if (arena == nullptr)
+		return new T[n];
+	auto p = static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+	for (size_t i = 0; i < n; ++i)
+		new (p + i) T;
+	return p;
 }
 
-Eid Entity::create()
+/// Destroy objects from `newArray`. Arena memory is only released by `Arena::reset`.
+template<class T> static void deleteArray(Entity::Arena* arena, T* p, size_t n)
 {
-	// auto allocate
-	Entity::alloc();
-	
-	Eid eid = 1;
-	for (; eid < kMaxEntities && entities[eid]; ++eid)
+	if (arena == nullptr)
 	{
+		delete [] p;
+		return;
 	}
+	for (size_t i = 0; i < n; ++i)
+		p[i].~T();
+}
 
-	if (eid < 1 || eid >= kMaxEntities)
+/// Return the index of the highest set bit of a non-zero word.
+static inline unsigned highestBit(uint64_t x)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanReverse64(&i, x);
+	return (unsigned)i;
+#else
+	return 63 - (unsigned)__builtin_clzll(x);
+#endif
+}
+
+//
+// Tracing
+//
+
+/// Read the fastest monotonic counter. Drains convert its ticks to nanoseconds.
+static inline uint64_t traceTicks()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+	return __rdtsc();
+#else
+	return (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+static inline uint64_t traceNanoseconds()
+{
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Events recorded by one thread. The thread writes `head` and the drainer writes `tail`.
+/// `retired` is set when the thread exits, after its last event.
+struct TraceRing
+{
+	enum {kSize = 1 << 13};
+
+	atomic<uint32_t> head, tail;
+	atomic<uint32_t> dropped;
+	atomic<bool> retired;
+	Entity::TraceEvent events[kSize];
+};
+
+/// Every thread's ring, indexed by the thread number in its events. Rings outlive their threads so their
+/// last events can still be drained, after which the drain frees them and a new thread takes the slot.
+static mutex traceMutex;
+static vector<TraceRing*> traceRings;
+static atomic<bool> tracing(false);
+
+/// Retires the thread's ring when the thread exits.
+struct TraceThread
+{
+	TraceRing* ring = nullptr;
+
+	~TraceThread()
 	{
-		Assert(false, "Maximum number of entities reached!");
-		eid = 0;
+		if (ring != nullptr)
+			ring->retired.store(true, memory_order_release);
 	}
-	else
+};
+static thread_local TraceThread traceThread;
+
+/// The counter and clock when tracing started, for converting ticks to nanoseconds.
+static uint64_t traceStartTicks = 0, traceStartNanoseconds = 0;
+
+static void traceRecord(unsigned op, Cid cid, Eid eid)
+{
+	auto ring = traceThread.ring;
+	if (ring == nullptr)
 	{
-		entities[eid] = true;
-		LogV(verbosity, 1, "Entity %u created", eid);
+		ring = new TraceRing;
+		ring->head.store(0, memory_order_relaxed);
+		ring->tail.store(0, memory_order_relaxed);
+		ring->dropped.store(0, memory_order_relaxed);
+		ring->retired.store(false, memory_order_relaxed);
+		lock_guard<mutex> lock(traceMutex);
+		auto slot = find(traceRings.begin(), traceRings.end(), nullptr);
+		if (slot != traceRings.end())
+			*slot = ring;
+		else
+			traceRings.push_back(ring);
+		traceThread.ring = ring;
 	}
-	
-	return eid;
+
+	auto head = ring->head.load(memory_order_relaxed);
+	if (head - ring->tail.load(memory_order_acquire) >= TraceRing::kSize)
+	{
+		ring->dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+	auto& event = ring->events[head & (TraceRing::kSize - 1)];
+	event.time = traceTicks();
+	event.eid = eid;
+	event.cid = cid;
+	event.op = (uint16_t)op;
+	ring->head.store(head + 1, memory_order_release);
 }
 
-void Entity::destroyNow(Eid eid)
+/// Record a structural change if tracing is on.
+static inline void traceEvent(unsigned op, Cid cid, Eid eid)
 {
-	if (eid == 0)
-		return;
-	LogV(verbosity, 1, "Entity %u being destroyed", eid);
+	if (tracing.load(memory_order_relaxed))
+		traceRecord(op, cid, eid);
+}
 
-	for (Cid cid = 0; cid < Component::numCids; cid++)
-		Entity::removeComponent(cid, eid);
-	entities[eid] = false;
+void Entity::trace(bool on)
+{
+	lock_guard<mutex> lock(traceMutex);
+	if (on && !tracing.load(memory_order_relaxed))
+	{
+		traceStartTicks = traceTicks();
+		traceStartNanoseconds = traceNanoseconds();
+	}
+	tracing.store(on, memory_order_relaxed);
 }
 
-void Entity::destroyAll()
+size_t Entity::drainTrace(vector<TraceEvent>& out, size_t* dropped)
 {
-	unsigned count = 0;
-	auto oldVerbosity = verbosity;
-	verbosity = 0;
-	for (Eid eid = 1; eid < kMaxEntities; ++eid)
+	lock_guard<mutex> lock(traceMutex);
+
+	// scale ticks to nanoseconds by how far each has moved since tracing started
+	auto ticks = traceTicks() - traceStartTicks;
+	auto ns = traceNanoseconds() - traceStartNanoseconds;
+	auto scale = ticks > 0 ? (double)ns / ticks : 1.0;
+
+	size_t n = 0;
+	if (dropped != nullptr)
+		*dropped = 0;
+	for (size_t r = 0; r < traceRings.size(); ++r)
 	{
-		if (entities[eid])
+		auto ring = traceRings[r];
+		if (ring == nullptr)
+			continue;
+
+		// a retired ring's head is final once the retirement is seen
+		auto retired = ring->retired.load(memory_order_acquire);
+		auto head = ring->head.load(memory_order_acquire);
+		auto tail = ring->tail.load(memory_order_relaxed);
+		for (; tail != head; ++tail, ++n)
 		{
-			Entity::destroyNow(eid);
-			count++;
+			auto event = ring->events[tail & (TraceRing::kSize - 1)];
+			event.time = traceStartNanoseconds + (uint64_t)((int64_t)(event.time - traceStartTicks) * scale);
+			event.thread = (uint16_t)r;
+			out.push_back(event);
+		}
+		ring->tail.store(tail, memory_order_release);
+		auto lost = ring->dropped.exchange(0, memory_order_relaxed);
+		if (dropped != nullptr)
+			*dropped += lost;
+		if (retired)
+		{
+			delete ring;
+			traceRings[r] = nullptr;
 		}
 	}
-	verbosity = oldVerbosity;
-	LogV(verbosity, 1, "%u entities destroyed", count);
+	return n;
 }
 
-void Entity::addComponent(Cid cid, Eid eid, Component* c)
+bool Entity::dumpTrace(const char* path)
 {
-	if (c == nullptr)
-		return;
-	if (eid >= kMaxEntities || !entities[eid] || cid >= Component::numCids)
+	auto file = path != nullptr ? fopen(path, "w") : stdout;
+	if (file == nullptr)
+		return false;
+
+	static const char* names[] = {"create", "destroy", "add", "remove"};
+	vector<TraceEvent> events;
+	size_t dropped;
+	drainTrace(events, &dropped);
+	for (auto& event : events)
 	{
-		Assert(false, "Invalid eid %u or cid %u", eid, cid);
-		return;
+		if (event.op == TraceEvent::Create || event.op == TraceEvent::Destroy)
+			fprintf(file, "%llu thread %u %s eid %u\n", (unsigned long long)event.time, event.thread, names[event.op], event.eid);
+		else
+			fprintf(file, "%llu thread %u %s cid %u eid %u\n", (unsigned long long)event.time, event.thread, names[event.op], event.cid, event.eid);
 	}
+	if (dropped > 0)
+		fprintf(file, "%llu events dropped\n", (unsigned long long)dropped);
+	return path != nullptr ? fclose(file) == 0 : fflush(file) == 0;
+}
 
-	if (verbosity >= 4)
-		log(cid);
-	LogV(verbosity, 3, "    Adding component cid %u eid %u (%x)", cid, eid, (int)(long)c);
-	
-	// if component already added, delete old one
-	if (components[cid][eid] != nullptr)
-		Entity::removeComponent(cid, eid);
-	
-	// pointers to components are stored in the map
-	// (components must be allocated with new, not stack objects)
-	components[cid][eid] = c;
-	
-	// store component eids
-	componentEids[cid].push_back(eid);
+//
+// Entity
+//
 
-	if (verbosity >= 4)
-		log(cid);
+/// The world used by the free functions on this thread, or null for the default world.
+static thread_local Entity::World* currentWorld = nullptr;
+
+Entity::World& Entity::getWorld()
+{
+	if (currentWorld != nullptr)
+		return *currentWorld;
+
+	// never destroyed, so it outlives any static which refers to it
+	static World* defaultWorld = new World;
+	return *defaultWorld;
 }
 
-void Entity::removeComponent(Cid cid, Eid eid)
+void Entity::setWorld(World* world)
 {
-	if (eid >= kMaxEntities || !entities[eid] || cid >= Component::numCids)
-	{
-		Assert(false, "Invalid eid %u or cid %u", eid, cid);
-		return;
-	}
+	currentWorld = world;
+}
 
-	// get pointer
-	auto ptr = components[cid][eid];
-	if (ptr == nullptr)
-		return;
+void Entity::alloc() {getWorld().alloc();}
+void Entity::dealloc() {getWorld().dealloc();}
+void Entity::useArena(bool on, size_t chunkSize) {getWorld().useArena(on, chunkSize);}
+Eid Entity::create() {return getWorld().create();}
+unsigned Entity::count() {return getWorld().count();}
+bool Entity::exists(Eid eid) {return getWorld().exists(eid);}
+const Entity::Bitset& Entity::getBits() {return getWorld().getBits();}
+void Entity::setParent(Eid child, Eid parent) {getWorld().setParent(child, parent);}
+Eid Entity::getParent(Eid eid) {return getWorld().getParent(eid);}
+Eid Entity::getFirstChild(Eid eid) {return getWorld().getFirstChild(eid);}
+Eid Entity::getNextSibling(Eid eid) {return getWorld().getNextSibling(eid);}
+const vector<Eid>& Entity::getHierarchy() {return getWorld().getHierarchy();}
+void Entity::destroyNow(Eid eid) {getWorld().destroyNow(eid);}
+void Entity::destroyAll() {getWorld().destroyAll();}
+unsigned Entity::createMany(unsigned n, Eid* out) {return getWorld().createMany(n, out);}
+void Entity::destroyMany(const Eid* eids, unsigned n) {getWorld().destroyMany(eids, n);}
+unsigned Entity::instantiate(const Prefab& prefab, unsigned n, Eid* out) {return getWorld().instantiate(prefab, n, out);}
+void Entity::addComponent(Cid cid, Eid eid, Component* c) {getWorld().addComponent(cid, eid, c);}
+void Entity::removeComponent(Cid cid, Eid eid) {getWorld().removeComponent(cid, eid);}
+Entity::Component* Entity::getComponent(Cid cid, Eid eid) {return getWorld().getComponent(cid, eid);}
+const vector<Eid>& Entity::getAll(Cid cid) {return getWorld().getAll(cid);}
+Entity::Component* const* Entity::getComponents(Cid cid) {return getWorld().getComponents(cid);}
+const Entity::Bitset& Entity::getBits(Cid cid) {return getWorld().getBits(cid);}
+unsigned Entity::count(Cid cid) {return getWorld().count(cid);}
+void Entity::addComponentMany(Cid cid, const Eid* eids, unsigned n, const Component& prototype) {getWorld().addComponentMany(cid, eids, n, prototype);}
+unsigned Entity::group(const vector<Cid>& cids) {return getWorld().group(cids);}
+unsigned Entity::groupSize(unsigned gid) {return getWorld().groupSize(gid);}
+void Entity::listen(Cid cid, Listener* listener) {getWorld().listen(cid, listener);}
+void Entity::unlisten(Cid cid, Listener* listener) {getWorld().unlisten(cid, listener);}
+void Entity::changed(Cid cid, Eid eid) {getWorld().changed(cid, eid);}
+void Entity::save(vector<char>& out) {getWorld().save(out);}
+bool Entity::save(const char* path) {return getWorld().save(path);}
+bool Entity::load(const Snapshot& snapshot) {return getWorld().load(snapshot);}
+bool Entity::load(const void* data, size_t size) {return getWorld().load(data, size);}
+bool Entity::load(const char* path) {return getWorld().load(path);}
+void Entity::diff(const Snapshot& from, vector<char>& out) {getWorld().diff(from, out);}
+bool Entity::apply(const void* delta, size_t size) {return getWorld().apply(delta, size);}
+uint64_t Entity::worldHash(const vector<Cid>& cids, bool incremental) {return getWorld().worldHash(cids, incremental);}
+Entity::Profiler& Entity::getProfiler() {return getWorld().getProfiler();}
+Entity::MemoryStats Entity::memoryStats() {return getWorld().memoryStats();}
+uint64_t Entity::allocations() {return allocationCount;}
 
-	if (verbosity >= 4)
-		log(cid);
-	LogV(verbosity, 3, "    Removing component cid %u eid %u (%x)", cid, eid, (int)(long)ptr);
+//
+// Component pools
+//
 
-	// pointers to components are deleted
-	delete ptr;
-	
-	// erase the component pointer
-	components[cid][eid] = nullptr;
+/// Pooled blocks, header included, are a multiple of `kPoolGranularity` bytes up to `kPoolClasses` of it.
+/// Each size class carves its blocks from slabs of its own, so components of one class are contiguous.
+enum {kPoolGranularity = 16, kPoolClasses = (Entity::kMaxPooledComponent + sizeof(Allocation)) / kPoolGranularity,
+	kSlabSize = 1 << 16};
 
-	// update component eids
-	auto& eids = componentEids[cid];
-	auto it = find(eids.begin(), eids.end(), eid);
-	if (it != eids.end())
-		it = eids.erase(it);
-	
-	if (verbosity >= 4)
-		log(cid);
-}
+/// A free block, linked through its first bytes.
+struct FreeBlock
+{
+	FreeBlock* next;
+};
+
+static atomic<bool> pooling(false);
+static atomic<size_t> poolSlabBytes(0);
 
-Entity::Component* Entity::getComponent(Cid cid, Eid eid)
+/// Each thread's free lists and the rest of the slab each size class is carving, indexed by size class.
+/// These are trivially destructible so they stay usable while other thread locals and statics are destroyed.
+static thread_local FreeBlock* freeBlocks[kPoolClasses + 1];
+static thread_local char* slabNext[kPoolClasses + 1];
+static thread_local char* slabEnd[kPoolClasses + 1];
+static thread_local bool poolsClosed = false;
+
+/// Free blocks left behind by threads which have exited, handed to the next thread which runs out.
+static mutex depotMutex;
+static FreeBlock* depot[kPoolClasses + 1];
+
+/// Hands a thread's free blocks to the depot when the thread exits.
+struct PoolCloser
 {
-#if (kTrustPointers == 0)
-	if (eid < kMaxEntities && cid < Component::numCids)
+	~PoolCloser()
 	{
-#endif
-		return components[cid][eid];
-
-#if (kTrustPointers == 0)
+		lock_guard<mutex> lock(depotMutex);
+		for (unsigned c = 1; c <= kPoolClasses; ++c)
+		{
+			while (freeBlocks[c] != nullptr)
+			{
+				auto block = freeBlocks[c];
+				freeBlocks[c] = block->next;
+				block->next = depot[c];
+				depot[c] = block;
+			}
+		}
+		poolsClosed = true;
 	}
-	return nullptr;
-#endif
+};
+
+static thread_local PoolCloser poolCloser;
+
+/// Make sure the thread's free blocks reach the depot when it exits.
+static inline void openPools()
+{
+	if (!poolsClosed)
+		(void)&poolCloser;
 }
 
-const vector<Eid>& Entity::getAll(Cid cid)
+static inline unsigned poolClass(size_t bytes)
 {
-	if (componentEids != nullptr && cid < Component::numCids)
-		return componentEids[cid];
-	static vector<Eid> blankEids;
-	return blankEids;
+	auto sizeClass = (bytes + kPoolGranularity - 1) / kPoolGranularity;
+	return sizeClass <= kPoolClasses ? (unsigned)sizeClass : 0;
 }
 
-unsigned Entity::count()
+static void* poolAllocate(unsigned sizeClass)
 {
-	int ret = 0;
-	if (entities != nullptr)
+	auto block = freeBlocks[sizeClass];
+	if (block != nullptr)
 	{
-		for (Eid eid = 1; eid < kMaxEntities; ++eid)
-			if (entities[eid])
-				++ret;
+		freeBlocks[sizeClass] = block->next;
+		return block;
 	}
-	return ret;
+
+	// refill from blocks which exited threads left behind
+	openPools();
+	{
+		lock_guard<mutex> lock(depotMutex);
+		block = depot[sizeClass];
+		depot[sizeClass] = nullptr;
+	}
+	if (block != nullptr)
+	{
+		freeBlocks[sizeClass] = block->next;
+		return block;
+	}
+
+	// carve from this class's slab, starting a new one when it runs out
+	size_t bytes = sizeClass * kPoolGranularity;
+	if (slabNext[sizeClass] == nullptr || slabNext[sizeClass] + bytes > slabEnd[sizeClass])
+	{
+		slabNext[sizeClass] = static_cast<char*>(::operator new(kSlabSize));
+		slabEnd[sizeClass] = slabNext[sizeClass] + kSlabSize;
+		poolSlabBytes += kSlabSize;
+		countAllocation();
+	}
+	auto p = slabNext[sizeClass];
+	slabNext[sizeClass] += bytes;
+	return p;
 }
 
-unsigned Entity::count(Cid cid)
+static void poolFree(unsigned sizeClass, void* p)
 {
-	return (unsigned)Entity::getAll(cid).size();
+	auto block = static_cast<FreeBlock*>(p);
+	if (freeBlocks[sizeClass] == nullptr)
+		openPools();
+	if (poolsClosed)
+	{
+		lock_guard<mutex> lock(depotMutex);
+		block->next = depot[sizeClass];
+		depot[sizeClass] = block;
+		return;
+	}
+	block->next = freeBlocks[sizeClass];
+	freeBlocks[sizeClass] = block;
 }
 
-bool Entity::exists(Eid eid)
+void Entity::useComponentPools(bool on)
 {
-	return entities != nullptr && entities[eid];
+	pooling.store(on, memory_order_relaxed);
 }
 
 //
-// Entity::Component
+// Entity::World
 //
 
-Entity::Component::~Component()
+Entity::World::World() :
+	verbosity(defaultVerbosity),
+	entities(nullptr),
+	componentBits(nullptr),
+	components(nullptr),
+	componentEids(nullptr),
+	componentPointers(nullptr),
+	componentIndices(nullptr),
+	claimed(nullptr),
+	firstFree(1),
+	reserveCursor(0),
+	links(nullptr),
+	hierarchyGaps(0),
+	recorder(nullptr),
+	telemetry(nullptr),
+	history(nullptr),
+	arena(nullptr),
+	foreignComponents(0)
 {
 }
 
-bool Entity::Component::full() const
+Entity::World::~World()
 {
-	return !this->empty();
+	dealloc();
+	if (recorder != nullptr)
+		recorder->world = nullptr;
+	if (telemetry != nullptr)
+		telemetry->world = nullptr;
+	if (history != nullptr)
+		history->world = nullptr;
+	delete arena;
 }
 
-//
-// System
-//
+/// Swap two slots of a component pool.
+void Entity::World::swapSlots(Cid cid, unsigned a, unsigned b)
+{
+	if (a == b)
+		return;
+	auto& eids = componentEids[cid];
+	auto& ptrs = componentPointers[cid];
+	std::swap(eids[a], eids[b]);
+	std::swap(ptrs[a], ptrs[b]);
+	componentIndices[cid][eids[a]] = a;
+	componentIndices[cid][eids[b]] = b;
+}
 
-void System::tick(double fixedDelta)
+/// Move an entity into the packed front of a group if it has every member component.
+void Entity::World::join(GroupData& group, Eid eid)
 {
+	for (auto cid : group.cids)
+		if (components[cid][eid] == nullptr)
+			return;
+	if (componentIndices[group.cids.front()][eid] < group.size)
+		return;
+	for (auto cid : group.cids)
+		swapSlots(cid, componentIndices[cid][eid], group.size);
+	group.size++;
 }
 
-void System::animate(double delta, double tickPercent)
+/// Move an entity out of the packed front of a group.
+void Entity::World::leave(GroupData& group, Eid eid)
+{
+	auto first = group.cids.front();
+	if (components[first][eid] == nullptr || componentIndices[first][eid] >= group.size)
+		return;
+	group.size--;
+	for (auto cid : group.cids)
+		swapSlots(cid, componentIndices[cid][eid], group.size);
+}
+
+void Entity::World::alloc()
+{
+	if (components != nullptr)
+		return;
+	LogV(verbosity, 1, "Allocing entities");
+
+	// allocate entities
+	entities = newArray<Bitset>(arena, 1);
+	firstFree = 1;
+
+	// Eid 0 and any bits past the end are claimed forever
+	claimed = newArray<atomic<uint64_t>>(arena, Bitset::kWords);
+	for (unsigned w = 0; w < Bitset::kWords; ++w)
+		claimed[w].store(0, memory_order_relaxed);
+	claimed[0].store(1, memory_order_relaxed);
+	for (Eid eid = kMaxEntities; eid < Bitset::kWords * 64; ++eid)
+		claimed[eid >> 6].fetch_or(uint64_t(1) << (eid & 63), memory_order_relaxed);
+
+	// allocate parent/child links
+	links = newArray<Link>(arena, kMaxEntities);
+	for (Eid eid = 0; eid < kMaxEntities; ++eid)
+		links[eid] = Link{0, 0, 0, 0, 0};
+	hierarchy.clear();
+	hierarchyGaps = 0;
+
+	// allocate components
+	auto max = Component::numCids;
+	components = newArray<Component**>(arena, max);
+	componentEids = newArray<vector<Eid>>(arena, max);
+	componentPointers = newArray<vector<Component*>>(arena, max);
+	componentIndices = newArray<unsigned*>(arena, max);
+	componentBits = newArray<Bitset>(arena, max);
+	for (Cid cid = 0; cid < max; cid++)
+	{
+		// component arrays are allocated when the first component is added
+		components[cid] = blankComponents;
+		componentIndices[cid] = nullptr;
+	}
+	componentGroups.resize(max, -1);
+	listeners.resize(max);
+	chunkHashes.assign(max, vector<uint64_t>(Bitset::kWords, 0));
+	dirtyChunks.assign(max, vector<uint64_t>(Bitset::kSummaryWords, ~uint64_t(0)));
+}
+
+void Entity::World::dealloc()
+{
+	LogV(verbosity, 1, "Deallocing entities");
+	auto max = Component::numCids;
+
+	// there is nothing left to rewind to
+	if (history != nullptr)
+		history->clear();
+
+	if (components != nullptr && arena != nullptr)
+	{
+		// everything in the arena goes at once, so only components allocated elsewhere are deleted
+		if (foreignComponents > 0)
+			for (Cid cid = 0; cid < max; cid++)
+				for (auto c : componentPointers[cid])
+					if (allocationOf(c)->arena != arena)
+						delete c;
+		foreignComponents = 0;
+		for (auto& group : groups)
+			group.size = 0;
+
+		// nothing is removed one by one, so listeners drop what they hold on to instead
+		for (auto& cidListeners : listeners)
+			for (auto listener : cidListeners)
+				listener->cleared();
+		hierarchyGaps = 0;
+	}
+	else if (components != nullptr)
+	{
+		destroyAll();
+		for (Cid cid = 0; cid < max; cid++)
+		{
+			if (components[cid] != blankComponents)
+				delete [] components[cid];
+			if (componentIndices[cid] != nullptr)
+				delete [] componentIndices[cid];
+		}
+		delete [] components;
+		delete [] componentIndices;
+	}
+
+	if (componentEids != nullptr)
+		deleteArray(arena, componentEids, max);
+
+	if (componentPointers != nullptr)
+		deleteArray(arena, componentPointers, max);
+
+	if (componentBits != nullptr)
+		deleteArray(arena, componentBits, max);
+
+	if (entities != nullptr)
+		deleteArray(arena, entities, 1);
+
+	if (links != nullptr)
+		deleteArray(arena, links, kMaxEntities);
+
+	if (claimed != nullptr)
+		deleteArray(arena, claimed, Bitset::kWords);
+
+	if (arena != nullptr)
+		arena->reset();
+	
+	entities = nullptr;
+	claimed = nullptr;
+	links = nullptr;
+	componentBits = nullptr;
+	components = nullptr;
+	componentEids = nullptr;
+	componentPointers = nullptr;
+	componentIndices = nullptr;
+}
+
+void Entity::World::useArena(bool on, size_t chunkSize)
 {
+	if (components != nullptr)
+	{
+		Assert(false, "Call useArena before the world allocates");
+		return;
+	}
+	delete arena;
+	arena = on ? new Arena(chunkSize) : nullptr;
+	LogV(verbosity, 1, "Arena %s", on ? "on" : "off");
+}
+
+Eid Entity::World::create()
+{
+	// auto allocate
+	alloc();
+	
+	// claim the lowest free Eid, racing only against spawners
+	Eid eid = 0;
+	for (unsigned w = firstFree >> 6; w < Bitset::kWords && eid == 0; )
+	{
+		auto word = claimed[w].load(memory_order_relaxed);
+		if (w == (firstFree >> 6))
+			word |= ~(~uint64_t(0) << (firstFree & 63));
+		if (~word == 0)
+		{
+			++w;
+			continue;
+		}
+		auto bit = uint64_t(1) << Bitset::ctz(~word);
+		if ((claimed[w].fetch_or(bit, memory_order_acq_rel) & bit) == 0)
+			eid = (w << 6) + Bitset::ctz(bit);
+	}
+
+	if (eid < 1 || eid >= kMaxEntities)
+	{
+		Assert(false, "Maximum number of entities reached!");
+		eid = 0;
+	}
+	else
+	{
+		entities->set(eid);
+		firstFree = eid + 1;
+		touch(eid);
+		traceEvent(TraceEvent::Create, 0, eid);
+		if (recorder != nullptr)
+			recorder->record(Recorder::Create, 0, eid);
+	}
+	
+	return eid;
+}
+
+/// Claim up to `max` free Eids for a spawner. Safe to call from any thread.
+unsigned Entity::World::reserve(Eid* out, unsigned max)
+{
+	unsigned n = 0;
+	for (unsigned tries = 0; tries < Bitset::kWords && n < max; ++tries)
+	{
+		auto w = reserveCursor.fetch_add(1, memory_order_relaxed) % Bitset::kWords;
+
+		// take only the free Eids which fit, so create never sees the rest of the word as claimed
+		auto word = claimed[w].load(memory_order_relaxed);
+		uint64_t take;
+		do
+		{
+			take = 0;
+			auto free = ~word;
+			for (unsigned k = n; free != 0 && k < max; ++k, free &= free - 1)
+				take |= free & (~free + 1);
+		}
+		while (take != 0 && !claimed[w].compare_exchange_weak(word, word | take, memory_order_acq_rel, memory_order_relaxed));
+
+		for (; take != 0; take &= take - 1)
+			out[n++] = (w << 6) + Bitset::ctz(take);
+	}
+	return n;
+}
+
+/// Release a claimed Eid. Safe to call from any thread.
+void Entity::World::release(Eid eid)
+{
+	claimed[eid >> 6].fetch_and(~(uint64_t(1) << (eid & 63)), memory_order_acq_rel);
+}
+
+/// Bring a specific Eid to life, as when loading or committing a spawner.
+void Entity::World::revive(Eid eid)
+{
+	claimed[eid >> 6].fetch_or(uint64_t(1) << (eid & 63), memory_order_relaxed);
+	entities->set(eid);
+	touch(eid);
+	traceEvent(TraceEvent::Create, 0, eid);
+	if (recorder != nullptr)
+		recorder->record(Recorder::Create, 0, eid);
+}
+
+void Entity::World::destroyNow(Eid eid)
+{
+	if (eid == 0)
+		return;
+	touch(eid);
+	traceEvent(TraceEvent::Destroy, 0, eid);
+	if (recorder != nullptr)
+		recorder->record(Recorder::Destroy, 0, eid);
+
+	// destroy children, deepest first
+	while (links[eid].firstChild != 0)
+	{
+		auto leaf = links[eid].firstChild;
+		while (links[leaf].firstChild != 0)
+			leaf = links[leaf].firstChild;
+		destroyNow(leaf);
+	}
+	if (links[eid].parent != 0)
+		setParent(eid, 0);
+
+	// the removals are part of the destruction, so are not recorded
+	auto rec = recorder;
+	recorder = nullptr;
+	for (Cid cid = 0; cid < Component::numCids; cid++)
+		removeComponent(cid, eid);
+	recorder = rec;
+	entities->clear(eid);
+	release(eid);
+	if (eid < firstFree)
+		firstFree = eid;
+}
+
+void Entity::World::destroyAll()
+{
+	if (entities == nullptr)
+		return;
+	Profiler::Scope scope(profiler, "Entity::destroyAll");
+	unsigned count = 0;
+	entities->each([&](Eid eid)
+	{
+		// children may already have been destroyed along with their parent
+		if (!entities->test(eid))
+			return;
+		destroyNow(eid);
+		count++;
+	});
+	profiler.processed(count);
+	LogV(verbosity, 1, "%u entities destroyed", count);
+}
+
+unsigned Entity::World::createMany(unsigned n, Eid* out)
+{
+	// auto allocate
+	alloc();
+	Profiler::Scope scope(profiler, "Entity::createMany");
+
+	// claim whole words of free Eids from the lowest free one, racing only against spawners
+	unsigned made = 0;
+	for (unsigned w = firstFree >> 6; w < Bitset::kWords && made < n; ++w)
+	{
+		auto word = claimed[w].load(memory_order_relaxed);
+		if (w == (firstFree >> 6))
+			word |= ~(~uint64_t(0) << (firstFree & 63));
+		auto free = ~word;
+		if (free == 0)
+			continue;
+
+		// take only as many as are still wanted
+		if (popcount(free) > n - made)
+		{
+			uint64_t take = 0;
+			for (unsigned i = made; i < n; ++i, free &= free - 1)
+				take |= free & (~free + 1);
+			free = take;
+		}
+		free &= ~claimed[w].fetch_or(free, memory_order_acq_rel);
+		entities->setWord(w, free);
+		for (; free != 0; free &= free - 1)
+		{
+			out[made] = (w << 6) + Bitset::ctz(free);
+			touch(out[made]);
+			traceEvent(TraceEvent::Create, 0, out[made]);
+			if (recorder != nullptr)
+				recorder->record(Recorder::Create, 0, out[made]);
+			made++;
+		}
+	}
+
+	if (made > 0)
+		firstFree = out[made - 1] + 1;
+	if (made < n)
+		Assert(false, "Maximum number of entities reached!");
+	profiler.processed(made);
+	LogV(verbosity, 1, "%u entities created", made);
+	return made;
+}
+
+void Entity::World::destroyMany(const Eid* eids, unsigned n)
+{
+	if (entities == nullptr)
+		return;
+	Profiler::Scope scope(profiler, "Entity::destroyMany");
+	unsigned count = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		// children may already have been destroyed along with their parent
+		if (eids[i] >= kMaxEntities || !entities->test(eids[i]))
+			continue;
+		destroyNow(eids[i]);
+		count++;
+	}
+	profiler.processed(count);
+	LogV(verbosity, 1, "%u entities destroyed", count);
+}
+
+void Entity::World::addComponentMany(Cid cid, const Eid* eids, unsigned n, const Component& prototype)
+{
+	auto type = Entity::getType(cid);
+	if (type == nullptr || components == nullptr || cid >= Component::numCids)
+	{
+		Assert(false, "Cannot add many of cid %u", cid);
+		return;
+	}
+	Profiler::Scope scope(profiler, "Entity::addComponentMany");
+	AllocateFrom allocating(arena);
+	profiler.processed(n);
+
+	// grow the pool once for the whole batch
+	componentEids[cid].reserve(componentEids[cid].size() + n);
+	componentPointers[cid].reserve(componentPointers[cid].size() + n);
+
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (eids[i] >= kMaxEntities || !entities->test(eids[i]))
+		{
+			Assert(false, "Invalid eid %u", eids[i]);
+			continue;
+		}
+
+		// plain data is copied as raw bytes over a default constructed component
+		Component* c;
+		if (type->plain)
+		{
+			c = type->create();
+			memcpy(Type::data(c), Type::data(&prototype), type->dataSize);
+		}
+		else
+			c = type->clone(&prototype);
+		addComponent(cid, eids[i], c);
+	}
+	LogV(verbosity, 1, "%u components of cid %u added", n, cid);
+}
+
+unsigned Entity::World::instantiate(const Prefab& prefab, unsigned n, Eid* out)
+{
+	Profiler::Scope scope(profiler, "Entity::instantiate");
+	n = createMany(n, out);
+	for (auto& part : prefab.parts)
+		addComponentMany(part.cid, out, n, *part.c);
+	return n;
+}
+
+void Entity::World::addComponent(Cid cid, Eid eid, Component* c)
+{
+	if (c == nullptr)
+		return;
+	if (eid >= kMaxEntities || !entities->test(eid) || cid >= Component::numCids)
+	{
+		Assert(false, "Invalid eid %u or cid %u", eid, cid);
+		return;
+	}
+
+	// allocate component array
+	if (components[cid] == blankComponents)
+	{
+		components[cid] = newArray<Component*>(arena, kMaxEntities);
+		fill(components[cid], components[cid] + kMaxEntities, nullptr);
+		componentIndices[cid] = newArray<unsigned>(arena, kMaxEntities);
+		if (arena == nullptr)
+			countAllocation(2);
+	}
+
+	// if component already added, delete old one
+	auto rec = recorder;
+	recorder = nullptr;
+	if (components[cid][eid] != nullptr)
+		removeComponent(cid, eid);
+	recorder = rec;
+	traceEvent(TraceEvent::Add, cid, eid);
+	if (recorder != nullptr)
+	{
+		auto type = Entity::getType(cid);
+		recorder->record(Recorder::Add, cid, eid, type != nullptr ? type->size : 0);
+	}
+	
+	// pointers to components are stored in the map
+	// (components must be allocated with new, not stack objects)
+	components[cid][eid] = c;
+	if (arena != nullptr && allocationOf(c)->arena != arena)
+		foreignComponents++;
+	
+	// store component eids
+	componentIndices[cid][eid] = (unsigned)componentEids[cid].size();
+	pushCounted(componentEids[cid], eid);
+	pushCounted(componentPointers[cid], c);
+	componentBits[cid].set(eid);
+	dirty(cid, eid);
+
+	// pack into owning group
+	if (componentGroups[cid] >= 0)
+		join(groups[componentGroups[cid]], eid);
+
+	// notify listeners
+	for (auto listener : listeners[cid])
+		listener->added(eid, c);
+}
+
+void Entity::World::removeComponent(Cid cid, Eid eid)
+{
+	if (eid >= kMaxEntities || !entities->test(eid) || cid >= Component::numCids)
+	{
+		Assert(false, "Invalid eid %u or cid %u", eid, cid);
+		return;
+	}
+
+	if (recorder != nullptr)
+		recorder->record(Recorder::Remove, cid, eid);
+
+	// get pointer
+	auto ptr = components[cid][eid];
+	if (ptr == nullptr)
+		return;
+
+	traceEvent(TraceEvent::Remove, cid, eid);
+
+	// notify listeners while the component is still valid
+	for (auto listener : listeners[cid])
+		listener->removed(eid, ptr);
+
+	// pointers to components are deleted
+	if (arena != nullptr && allocationOf(ptr)->arena != arena)
+		foreignComponents--;
+	delete ptr;
+	
+	// unpack from owning group
+	if (componentGroups[cid] >= 0)
+		leave(groups[componentGroups[cid]], eid);
+
+	// erase the component pointer
+	components[cid][eid] = nullptr;
+	componentBits[cid].clear(eid);
+	dirty(cid, eid);
+
+	// update component eids by moving the last one into this slot
+	auto& eids = componentEids[cid];
+	auto i = componentIndices[cid][eid];
+	swapSlots(cid, i, (unsigned)eids.size() - 1);
+	eids.pop_back();
+	componentPointers[cid].pop_back();
+}
+
+Entity::Component* Entity::World::getComponent(Cid cid, Eid eid)
+{
+	if (recorder != nullptr)
+		recorder->record(Recorder::Get, cid, eid);
+#if (kTrustPointers == 0)
+	if (eid < kMaxEntities && cid < Component::numCids)
+	{
+#endif
+		return components[cid][eid];
+
+#if (kTrustPointers == 0)
+	}
+	return nullptr;
+#endif
+}
+
+const vector<Eid>& Entity::World::getAll(Cid cid)
+{
+	if (recorder != nullptr)
+		recorder->record(Recorder::GetAll, cid, 0);
+	if (componentEids != nullptr && cid < Component::numCids)
+		return componentEids[cid];
+	static vector<Eid> blankEids;
+	return blankEids;
+}
+
+void Entity::World::setParent(Eid child, Eid parent)
+{
+	if (!exists(child) || (parent != 0 && !exists(parent)))
+	{
+		Assert(false, "Invalid child %u or parent %u", child, parent);
+		return;
+	}
+	auto& link = links[child];
+	if (link.parent == parent)
+		return;
+	auto oldParent = link.parent;
+	touch(child);
+
+	// refuse to create a cycle
+	if (parent != 0 && isWithin(parent, child))
+	{
+		Assert(false, "Entity %u cannot be parented to its descendant %u", child, parent);
+		return;
+	}
+
+	// unlink from the old parent
+	if (link.parent != 0)
+	{
+		if (link.prevSibling != 0)
+			links[link.prevSibling].nextSibling = link.nextSibling;
+		else
+			links[link.parent].firstChild = link.nextSibling;
+		if (link.nextSibling != 0)
+			links[link.nextSibling].prevSibling = link.prevSibling;
+	}
+
+	// link to the new parent
+	link.parent = parent;
+	link.prevSibling = 0;
+	link.nextSibling = 0;
+	if (parent != 0)
+	{
+		link.nextSibling = links[parent].firstChild;
+		if (link.nextSibling != 0)
+			links[link.nextSibling].prevSibling = child;
+		links[parent].firstChild = child;
+	}
+
+	// keep every entity after its parent, moving only the child's subtree and only when it has to
+	if (parent != 0)
+	{
+		if (links[parent].order == 0)
+			orderAppend(parent);
+		if (link.order <= links[parent].order)
+			orderSubtree(child);
+	}
+	else if (link.firstChild == 0)
+		orderRemove(child);
+	if (oldParent != 0 && links[oldParent].parent == 0 && links[oldParent].firstChild == 0)
+		orderRemove(oldParent);
+}
+
+/// Return true if `eid` is `ancestor` or one of its descendants.
+bool Entity::World::isWithin(Eid eid, Eid ancestor) const
+{
+	for (auto p = eid; p != 0; p = links[p].parent)
+		if (p == ancestor)
+			return true;
+	return false;
+}
+
+void Entity::World::orderAppend(Eid eid)
+{
+	pushCounted(hierarchy, eid);
+	links[eid].order = (unsigned)hierarchy.size();
+}
+
+void Entity::World::orderRemove(Eid eid)
+{
+	auto& link = links[eid];
+	if (link.order == 0)
+		return;
+	hierarchy[link.order - 1] = 0;
+	link.order = 0;
+	hierarchyGaps++;
+}
+
+void Entity::World::orderSubtree(Eid eid)
+{
+	// append breadth-first, using the end of the order itself as the queue
+	auto start = hierarchy.size();
+	orderRemove(eid);
+	orderAppend(eid);
+	for (auto i = start; i < hierarchy.size(); ++i)
+	{
+		for (auto child = links[hierarchy[i]].firstChild; child != 0; child = links[child].nextSibling)
+		{
+			orderRemove(child);
+			orderAppend(child);
+		}
+	}
+}
+
+Eid Entity::World::getParent(Eid eid)
+{
+	return exists(eid) ? links[eid].parent : 0;
+}
+
+Eid Entity::World::getFirstChild(Eid eid)
+{
+	return exists(eid) ? links[eid].firstChild : 0;
+}
+
+Eid Entity::World::getNextSibling(Eid eid)
+{
+	return exists(eid) ? links[eid].nextSibling : 0;
+}
+
+const vector<Eid>& Entity::World::getHierarchy()
+{
+	if (hierarchyGaps == 0)
+		return hierarchy;
+
+	// close the gaps left by removed entities, keeping the order of the rest
+	unsigned n = 0;
+	for (auto eid : hierarchy)
+	{
+		if (eid == 0)
+			continue;
+		hierarchy[n++] = eid;
+		links[eid].order = n;
+	}
+	hierarchy.resize(n);
+	hierarchyGaps = 0;
+	return hierarchy;
+}
+
+void Entity::World::listen(Cid cid, Listener* listener)
+{
+	alloc();
+	if (cid >= Component::numCids || listener == nullptr)
+	{
+		Assert(false, "Invalid cid %u", cid);
+		return;
+	}
+	listeners[cid].push_back(listener);
+}
+
+void Entity::World::unlisten(Cid cid, Listener* listener)
+{
+	if (cid >= listeners.size())
+		return;
+	auto& v = listeners[cid];
+	v.erase(remove(v.begin(), v.end(), listener), v.end());
+}
+
+void Entity::World::changed(Cid cid, Eid eid)
+{
+	if (components == nullptr || cid >= Component::numCids || eid >= kMaxEntities)
+		return;
+	auto c = components[cid][eid];
+	if (c == nullptr)
+		return;
+	dirty(cid, eid);
+	for (auto listener : listeners[cid])
+		listener->changed(eid, c);
+}
+
+Entity::Component* const* Entity::World::getComponents(Cid cid)
+{
+	if (recorder != nullptr)
+		recorder->record(Recorder::GetComponents, cid, 0);
+	if (componentPointers != nullptr && cid < Component::numCids)
+		return componentPointers[cid].data();
+	return nullptr;
+}
+
+unsigned Entity::World::group(const vector<Cid>& cids)
+{
+	alloc();
+
+	GroupData group;
+	group.size = 0;
+	for (auto cid : cids)
+	{
+		if (cid >= Component::numCids || componentGroups[cid] >= 0)
+		{
+			Assert(false, "Invalid cid %u or cid already owned by a group", cid);
+			continue;
+		}
+		if (find(group.cids.begin(), group.cids.end(), cid) == group.cids.end())
+			group.cids.push_back(cid);
+	}
+
+	auto gid = (unsigned)groups.size();
+	for (auto cid : group.cids)
+		componentGroups[cid] = gid;
+
+	// pack the entities which already have every member
+	if (!group.cids.empty())
+	{
+		auto eids = componentEids[group.cids.front()];
+		for (auto eid : eids)
+			join(group, eid);
+	}
+	groups.push_back(group);
+	LogV(verbosity, 1, "Group %u created with %u entities", gid, group.size);
+	return gid;
+}
+
+unsigned Entity::World::groupSize(unsigned gid)
+{
+	return gid < groups.size() ? groups[gid].size : 0;
+}
+
+const Entity::Bitset& Entity::World::getBits(Cid cid)
+{
+	if (componentBits != nullptr && cid < Component::numCids)
+		return componentBits[cid];
+	static Bitset blankBits;
+	return blankBits;
+}
+
+const Entity::Bitset& Entity::World::getBits()
+{
+	if (entities != nullptr)
+		return *entities;
+	static Bitset blankBits;
+	return blankBits;
+}
+
+unsigned Entity::World::count()
+{
+	return entities != nullptr ? entities->count() : 0;
+}
+
+unsigned Entity::World::count(Cid cid)
+{
+	if (componentEids != nullptr && cid < Component::numCids)
+		return (unsigned)componentEids[cid].size();
+	return 0;
+}
+
+bool Entity::World::exists(Eid eid)
+{
+	return entities != nullptr && eid < kMaxEntities && entities->test(eid);
+}
+
+Entity::Profiler& Entity::World::getProfiler()
+{
+	return profiler;
+}
+
+Entity::MemoryStats Entity::World::memoryStats()
+{
+	MemoryStats stats;
+	memoryStats(stats);
+	return stats;
+}
+
+void Entity::World::memoryStats(MemoryStats& stats)
+{
+	// keep the pool vector's buffer so repeated measurements do not allocate
+	auto pools = move(stats.pools);
+	pools.clear();
+	stats = MemoryStats();
+	stats.pools = move(pools);
+	if (components != nullptr)
+	{
+		stats.entityBytes = sizeof(Bitset) + Bitset::kWords * sizeof(atomic<uint64_t>);
+		stats.linkBytes = kMaxEntities * sizeof(Link) + hierarchy.capacity() * sizeof(Eid);
+	}
+
+	for (Cid cid = 0; components != nullptr && cid < Component::numCids; cid++)
+	{
+		MemoryStats::Pool pool = {};
+		pool.cid = cid;
+		pool.count = (unsigned)componentEids[cid].size();
+		if (components[cid] != blankComponents)
+			pool.sparseBytes = kMaxEntities * (sizeof(Component*) + sizeof(unsigned));
+		pool.denseBytes = componentEids[cid].capacity() * sizeof(Eid) + componentPointers[cid].capacity() * sizeof(Component*);
+		pool.denseUsedBytes = pool.count * (sizeof(Eid) + sizeof(Component*));
+		auto type = Entity::getType(cid);
+		pool.described = type != nullptr;
+		pool.payloadBytes = pool.described ? (size_t)pool.count * (sizeof(Allocation) + type->size) : 0;
+		pool.bitsBytes = sizeof(Bitset) + (chunkHashes[cid].capacity() + dirtyChunks[cid].capacity()) * sizeof(uint64_t);
+
+		// a sparse entry is used when its entity has the component
+		pool.capacityBytes = pool.sparseBytes + pool.denseBytes + pool.payloadBytes;
+		pool.usedBytes = pool.denseUsedBytes + pool.payloadBytes;
+		if (pool.sparseBytes > 0)
+			pool.usedBytes += pool.count * (sizeof(Component*) + sizeof(unsigned));
+		if (pool.capacityBytes > 0)
+			pool.fragmentation = 1.0 - (double)pool.usedBytes / pool.capacityBytes;
+
+		stats.poolBytes += pool.capacityBytes + pool.bitsBytes;
+		stats.pools.push_back(pool);
+	}
+
+	for (auto& group : groups)
+		stats.groupBytes += sizeof(GroupData) + group.cids.capacity() * sizeof(Cid);
+	stats.groupBytes += componentGroups.capacity() * sizeof(int);
+	for (auto& cidListeners : listeners)
+		stats.groupBytes += sizeof(cidListeners) + cidListeners.capacity() * sizeof(Listener*);
+	stats.profilerBytes = profiler.memoryUsed();
+
+	stats.totalBytes = sizeof(World) + stats.entityBytes + stats.linkBytes + stats.poolBytes + stats.groupBytes +
+		stats.profilerBytes + hashBuffer.capacity();
+	if (arena != nullptr)
+	{
+		stats.arenaBytes = arena->reserved();
+		stats.arenaUsedBytes = arena->used();
+	}
+	stats.componentPoolBytes = poolSlabBytes.load(memory_order_relaxed);
+}
+
+//
+// Snapshots
+//
+
+void Entity::describe(Cid cid, const Type& type)
+{
+	if (cid >= Component::numCids)
+	{
+		Assert(false, "Invalid cid %u", cid);
+		return;
+	}
+	if (types.size() < Component::numCids)
+		types.resize(Component::numCids, Type{0, 0, false, nullptr, nullptr});
+	types[cid] = type;
+}
+
+const Entity::Type* Entity::getType(Cid cid)
+{
+	if (cid < types.size() && types[cid].create != nullptr)
+		return &types[cid];
+	return nullptr;
+}
+
+/// The snapshot file layout.
+/// Header, live entity words, parent of each entity, one `SnapshotPool` per `Cid`, then each pool's Eids and data.
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t maxEntities;
+	uint32_t numCids;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+struct SnapshotPool
+{
+	uint32_t cid;
+	uint32_t count;
+	uint32_t dataSize;
+	uint32_t saved;
+	uint64_t eidsOffset;
+	uint64_t dataOffset;
+};
+
+static const char snapshotMagic[8] = {'E', 'n', 't', 'i', 't', 'y', 'F', 'u'};
+
+static inline uint64_t align8(uint64_t n)
+{
+	return (n + 7) & ~uint64_t(7);
+}
+
+void Entity::World::save(vector<char>& out)
+{
+	alloc();
+	auto numCids = Component::numCids;
+
+	// lay out the sections
+	uint64_t size = sizeof(SnapshotHeader);
+	auto liveOffset = size;
+	size += Bitset::kWords * sizeof(uint64_t);
+	auto parentsOffset = size;
+	size = align8(size + kMaxEntities * sizeof(Eid));
+	auto poolsOffset = size;
+	size += numCids * sizeof(SnapshotPool);
+	vector<SnapshotPool> pools(numCids);
+	for (Cid cid = 0; cid < numCids; ++cid)
+	{
+		auto type = Entity::getType(cid);
+		auto& pool = pools[cid];
+		pool.cid = cid;
+		pool.saved = type != nullptr && type->plain;
+		pool.count = pool.saved ? (uint32_t)componentEids[cid].size() : 0;
+		pool.dataSize = pool.saved ? type->dataSize : 0;
+		pool.eidsOffset = size;
+		size = align8(size + pool.count * sizeof(Eid));
+		pool.dataOffset = size;
+		size = align8(size + (uint64_t)pool.count * pool.dataSize);
+	}
+
+	out.resize(size);
+	auto base = out.data();
+
+	// header
+	SnapshotHeader header;
+	memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = Snapshot::kVersion;
+	header.maxEntities = kMaxEntities;
+	header.numCids = numCids;
+	header.reserved = 0;
+	header.size = size;
+	memcpy(base, &header, sizeof(header));
+
+	// entities and parents
+	memcpy(base + liveOffset, entities->words, Bitset::kWords * sizeof(uint64_t));
+	auto parents = reinterpret_cast<Eid*>(base + parentsOffset);
+	for (Eid eid = 0; eid < kMaxEntities; ++eid)
+		parents[eid] = links[eid].parent;
+
+	// component pools
+	memcpy(base + poolsOffset, pools.data(), numCids * sizeof(SnapshotPool));
+	for (auto& pool : pools)
+	{
+		if (pool.count == 0)
+			continue;
+		memcpy(base + pool.eidsOffset, componentEids[pool.cid].data(), pool.count * sizeof(Eid));
+		auto ptrs = componentPointers[pool.cid].data();
+		auto dst = base + pool.dataOffset;
+		for (unsigned i = 0; i < pool.count; ++i, dst += pool.dataSize)
+			memcpy(dst, Type::data(ptrs[i]), pool.dataSize);
+	}
+	LogV(verbosity, 1, "Saved snapshot of %u entities in %llu bytes", count(), (unsigned long long)size);
+}
+
+bool Entity::World::save(const char* path)
+{
+	vector<char> buffer;
+	save(buffer);
+	auto file = fopen(path, "wb");
+	if (file == nullptr)
+		return false;
+	auto ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+	return fclose(file) == 0 && ok;
+}
+
+bool Entity::Snapshot::open(const void* data, size_t size)
+{
+	auto base = static_cast<const char*>(data);
+	SnapshotHeader header;
+	if (base == nullptr || size < sizeof(header))
+		return false;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != kVersion || header.size > size)
+		return false;
+
+	// sections follow the same layout as `Entity::save`
+	uint64_t offset = sizeof(SnapshotHeader);
+	auto words = (header.maxEntities + 63) / 64;
+	auto liveOffset = offset;
+	offset += words * sizeof(uint64_t);
+	auto parentsOffset = offset;
+	offset = align8(offset + (uint64_t)header.maxEntities * sizeof(Eid));
+	auto poolsOffset = offset;
+	offset += (uint64_t)header.numCids * sizeof(SnapshotPool);
+	if (offset > header.size)
+		return false;
+
+	// the data may be corrupt, so every Eid must be checked before anything indexes by it
+	auto liveWords = reinterpret_cast<const uint64_t*>(base + liveOffset);
+	auto parentEids = reinterpret_cast<const Eid*>(base + parentsOffset);
+	if (header.maxEntities > 0 && (liveWords[0] & 1) != 0)
+		return false;
+	if ((header.maxEntities & 63) != 0 && (liveWords[words - 1] >> (header.maxEntities & 63)) != 0)
+		return false;
+	auto isLive = [&](uint32_t eid) {return ((liveWords[eid >> 6] >> (eid & 63)) & 1) != 0;};
+	for (uint32_t eid = 0; eid < header.maxEntities; ++eid)
+	{
+		auto parent = parentEids[eid];
+		if (parent >= header.maxEntities || (parent != 0 && (!isLive(eid) || !isLive(parent))))
+			return false;
+	}
+
+	// parent links must form trees: walk up from each entity, failing on a return to the walk in progress
+	vector<uint8_t> state(header.maxEntities, 0);
+	enum {kUnvisited, kWalking, kRooted};
+	for (uint32_t eid = 1; eid < header.maxEntities; ++eid)
+	{
+		auto p = eid;
+		while (p != 0 && state[p] == kUnvisited)
+		{
+			state[p] = kWalking;
+			p = parentEids[p];
+		}
+		if (p != 0 && state[p] == kWalking)
+			return false;
+		for (p = eid; p != 0 && state[p] == kWalking; p = parentEids[p])
+			state[p] = kRooted;
+	}
+
+	maxEntities = header.maxEntities;
+	live = liveWords;
+	parents = parentEids;
+	pools.clear();
+	auto table = reinterpret_cast<const SnapshotPool*>(base + poolsOffset);
+	for (uint32_t i = 0; i < header.numCids; ++i)
+	{
+		auto& p = table[i];
+		if (!p.saved)
+			continue;
+		if (p.cid >= Component::numCids || p.eidsOffset % sizeof(Eid) != 0 ||
+			p.eidsOffset + (uint64_t)p.count * sizeof(Eid) > header.size ||
+			p.dataOffset + (uint64_t)p.count * p.dataSize > header.size)
+			return false;
+		auto eids = reinterpret_cast<const Eid*>(base + p.eidsOffset);
+		for (uint32_t j = 0; j < p.count; ++j)
+			if (eids[j] >= header.maxEntities)
+				return false;
+		Pool pool;
+		pool.cid = p.cid;
+		pool.count = p.count;
+		pool.dataSize = p.dataSize;
+		pool.eids = reinterpret_cast<const Eid*>(base + p.eidsOffset);
+		pool.data = base + p.dataOffset;
+		pools.push_back(pool);
+	}
+	return true;
+}
+
+bool Entity::World::load(const Snapshot& snapshot)
+{
+	Profiler::Scope scope(profiler, "Entity::load");
+	AllocateFrom allocating(arena);
+	if (snapshot.maxEntities > kMaxEntities)
+	{
+		Assert(false, "Snapshot has more entities than kMaxEntities");
+		return false;
+	}
+	alloc();
+	destroyAll();
+
+	// entities
+	auto words = (snapshot.maxEntities + 63) / 64;
+	for (unsigned w = 0; w < words; ++w)
+		for (auto bits = snapshot.live[w]; bits != 0; bits &= bits - 1)
+			revive((w << 6) + Bitset::ctz(bits));
+	firstFree = 1;
+
+	// parent links, which `open` has checked, though a view filled in by hand has not been
+	auto ok = true;
+	entities->each([&](Eid eid)
+	{
+		auto parent = snapshot.parents[eid];
+		if (parent == 0)
+			return;
+		if (entities->test(parent) && !isWithin(parent, eid))
+			setParent(eid, parent);
+		else
+			ok = false;
+	});
+
+	// components
+	for (auto& pool : snapshot.pools)
+	{
+		auto type = Entity::getType(pool.cid);
+		if (type == nullptr || !type->plain || type->dataSize != pool.dataSize)
+		{
+			LogV(verbosity, 1, "Snapshot pool for cid %u does not match its type", pool.cid);
+			ok = false;
+			continue;
+		}
+		componentEids[pool.cid].reserve(pool.count);
+		componentPointers[pool.cid].reserve(pool.count);
+		auto src = pool.data;
+		for (unsigned i = 0; i < pool.count; ++i, src += pool.dataSize)
+		{
+			// a component of an entity which is not live is corrupt
+			if (!entities->test(pool.eids[i]))
+			{
+				ok = false;
+				continue;
+			}
+			auto c = type->create();
+			memcpy(Type::data(c), src, pool.dataSize);
+			addComponent(pool.cid, pool.eids[i], c);
+		}
+	}
+	LogV(verbosity, 1, "Loaded snapshot of %u entities", count());
+	return ok;
+}
+
+bool Entity::World::load(const void* data, size_t size)
+{
+	Snapshot snapshot;
+	return snapshot.open(data, size) && load(snapshot);
+}
+
+bool Entity::World::load(const char* path)
+{
+#ifndef _WIN32
+	auto fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	auto size = (size_t)st.st_size;
+	auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	auto ok = load(data, size);
+	munmap(data, size);
+	return ok;
+#else
+	auto file = fopen(path, "rb");
+	if (file == nullptr)
+		return false;
+	vector<char> buffer;
+	fseek(file, 0, SEEK_END);
+	buffer.resize((size_t)ftell(file));
+	fseek(file, 0, SEEK_SET);
+	auto ok = fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+	fclose(file);
+	return ok && load(buffer.data(), buffer.size());
+#endif
+}
+
+//
+// Deltas
+//
+
+/// Delta records. Each is an opcode followed by varints and raw bytes.
+enum DeltaOp : uint8_t
+{
+	kDeltaEnd,
+	kDeltaDestroy, // eid
+	kDeltaCreate, // eid
+	kDeltaParent, // eid, parent
+	kDeltaRemove, // cid, eid
+	kDeltaAdd, // cid, eid, size, bytes
+	kDeltaPatch, // cid, eid, runs, then for each run: offset, length, bytes
+};
+
+static const char deltaMagic[8] = {'E', 'n', 't', 'i', 't', 'y', 'F', 'd'};
+
+/// Runs of changed bytes closer together than this are merged into one.
+static const unsigned kDeltaMergeGap = 8;
+
+static inline void putVarint(vector<char>& out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out.push_back((char)(v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((char)v);
+}
+
+static inline void putBytes(vector<char>& out, const char* p, size_t n)
+{
+	out.insert(out.end(), p, p + n);
+}
+
+/// Reads a delta with bounds checking. Reading past the end sets `failed`.
+struct DeltaReader
+{
+	const char* p;
+	const char* end;
+	bool failed;
+
+	uint64_t varint()
+	{
+		uint64_t v = 0;
+		for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+		{
+			auto byte = (uint8_t)*p++;
+			v |= uint64_t(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0)
+				return v;
+		}
+		failed = true;
+		return 0;
+	}
+
+	const char* bytes(uint64_t n)
+	{
+		if ((uint64_t)(end - p) < n)
+		{
+			failed = true;
+			return nullptr;
+		}
+		auto ret = p;
+		p += n;
+		return ret;
+	}
+};
+
+/// Write the runs of bytes which differ between two copies of a component, if any.
+static void putPatch(vector<char>& out, Cid cid, Eid eid, const char* oldData, const char* newData, unsigned size)
+{
+	if (memcmp(oldData, newData, size) == 0)
+		return;
+
+	// find the runs of changed bytes
+	vector<pair<unsigned, unsigned>> runs;
+	for (unsigned j = 0; j < size; ++j)
+	{
+		if (oldData[j] == newData[j])
+			continue;
+		if (!runs.empty() && j - (runs.back().first + runs.back().second) < kDeltaMergeGap)
+			runs.back().second = j + 1 - runs.back().first;
+		else
+			runs.push_back(make_pair(j, 1u));
+	}
+	out.push_back(kDeltaPatch);
+	putVarint(out, cid);
+	putVarint(out, eid);
+	putVarint(out, runs.size());
+	for (auto& run : runs)
+	{
+		putVarint(out, run.first);
+		putVarint(out, run.second);
+		putBytes(out, newData + run.first, run.second);
+	}
+}
+
+/// Map each Eid of a pool to its index.
+static void indexPool(const Entity::Snapshot::Pool* pool, vector<unsigned>& index)
+{
+	index.assign(index.size(), ~0u);
+	if (pool != nullptr)
+		for (unsigned i = 0; i < pool->count; ++i)
+			index[pool->eids[i]] = i;
+}
+
+static const Entity::Snapshot::Pool* findPool(const Entity::Snapshot& snapshot, Cid cid)
+{
+	for (auto& pool : snapshot.pools)
+		if (pool.cid == cid)
+			return &pool;
+	return nullptr;
+}
+
+void Entity::diff(const Snapshot& from, const Snapshot& to, vector<char>& out)
+{
+	out.clear();
+	putBytes(out, deltaMagic, sizeof(deltaMagic));
+	auto maxEntities = max(from.maxEntities, to.maxEntities);
+	auto parentOf = [](const Snapshot& s, Eid eid) -> Eid {return s.exists(eid) ? s.parents[eid] : 0;};
+
+	// detach entities whose parent changes, so destroying an old parent cannot cascade into them
+	for (Eid eid = 1; eid < maxEntities; ++eid)
+	{
+		if (from.exists(eid) && to.exists(eid) && parentOf(from, eid) != 0 && parentOf(from, eid) != parentOf(to, eid))
+		{
+			out.push_back(kDeltaParent);
+			putVarint(out, eid);
+			putVarint(out, 0);
+		}
+	}
+
+	// destroyed and created entities
+	for (Eid eid = 1; eid < maxEntities; ++eid)
+	{
+		auto was = from.exists(eid), is = to.exists(eid);
+		if (was != is)
+		{
+			out.push_back(is ? kDeltaCreate : kDeltaDestroy);
+			putVarint(out, eid);
+		}
+	}
+
+	// attach entities to their new parents
+	for (Eid eid = 1; eid < maxEntities; ++eid)
+	{
+		auto parent = parentOf(to, eid);
+		if (parent != 0 && (parent != parentOf(from, eid) || !from.exists(eid)))
+		{
+			out.push_back(kDeltaParent);
+			putVarint(out, eid);
+			putVarint(out, parent);
+		}
+	}
+
+	// components
+	vector<unsigned> index(maxEntities);
+	vector<Cid> cids;
+	for (auto& pool : from.pools)
+		cids.push_back(pool.cid);
+	for (auto& pool : to.pools)
+		if (find(cids.begin(), cids.end(), pool.cid) == cids.end())
+			cids.push_back(pool.cid);
+	for (auto cid : cids)
+	{
+		auto a = findPool(from, cid), b = findPool(to, cid);
+
+		// removed, unless the whole entity was destroyed
+		indexPool(b, index);
+		if (a != nullptr)
+		{
+			for (unsigned i = 0; i < a->count; ++i)
+			{
+				auto eid = a->eids[i];
+				if (index[eid] == ~0u && to.exists(eid))
+				{
+					out.push_back(kDeltaRemove);
+					putVarint(out, cid);
+					putVarint(out, eid);
+				}
+			}
+		}
+		if (b == nullptr)
+			continue;
+
+		// added or changed
+		indexPool(a, index);
+		auto size = b->dataSize;
+		for (unsigned i = 0; i < b->count; ++i)
+		{
+			auto eid = b->eids[i];
+			auto newData = b->data + (size_t)i * size;
+			if (index[eid] == ~0u || a->dataSize != size || !from.exists(eid))
+			{
+				out.push_back(kDeltaAdd);
+				putVarint(out, cid);
+				putVarint(out, eid);
+				putVarint(out, size);
+				putBytes(out, newData, size);
+				continue;
+			}
+			putPatch(out, cid, eid, a->data + (size_t)index[eid] * size, newData, size);
+		}
+	}
+	out.push_back(kDeltaEnd);
+}
+
+void Entity::World::diff(const Snapshot& from, vector<char>& out)
+{
+	vector<char> buffer;
+	save(buffer);
+	Snapshot to;
+	to.open(buffer.data(), buffer.size());
+	Entity::diff(from, to, out);
+}
+
+bool Entity::World::apply(const void* delta, size_t size)
+{
+	Profiler::Scope scope(profiler, "Entity::apply");
+	AllocateFrom allocating(arena);
+	alloc();
+	auto base = static_cast<const char*>(delta);
+	if (base == nullptr || size < sizeof(deltaMagic) || memcmp(base, deltaMagic, sizeof(deltaMagic)) != 0)
+		return false;
+
+	DeltaReader in = {base + sizeof(deltaMagic), base + size, false};
+	while (!in.failed)
+	{
+		auto p = in.bytes(1);
+		if (p == nullptr || *p == kDeltaEnd)
+			break;
+		auto op = (DeltaOp)*p;
+		switch (op)
+		{
+			case kDeltaDestroy:
+			{
+				auto eid = (Eid)in.varint();
+				if (exists(eid))
+					destroyNow(eid);
+				break;
+			}
+			case kDeltaCreate:
+			{
+				auto eid = (Eid)in.varint();
+				if (eid == 0 || eid >= kMaxEntities)
+					return false;
+				revive(eid);
+				break;
+			}
+			case kDeltaParent:
+			{
+				auto eid = (Eid)in.varint();
+				auto parent = (Eid)in.varint();
+				if (!exists(eid) || (parent != 0 && (!exists(parent) || isWithin(parent, eid))))
+					return false;
+				setParent(eid, parent);
+				break;
+			}
+			case kDeltaRemove:
+			{
+				auto cid = (Cid)in.varint();
+				auto eid = (Eid)in.varint();
+				if (exists(eid) && cid < Component::numCids)
+					removeComponent(cid, eid);
+				break;
+			}
+			case kDeltaAdd:
+			{
+				auto cid = (Cid)in.varint();
+				auto eid = (Eid)in.varint();
+				auto n = in.varint();
+				auto data = in.bytes(n);
+				auto type = Entity::getType(cid);
+				if (in.failed || type == nullptr || !type->plain || type->dataSize != n || !exists(eid))
+					return false;
+				auto c = type->create();
+				memcpy(Type::data(c), data, n);
+				addComponent(cid, eid, c);
+				break;
+			}
+			case kDeltaPatch:
+			{
+				auto cid = (Cid)in.varint();
+				auto eid = (Eid)in.varint();
+				auto runs = in.varint();
+				auto type = Entity::getType(cid);
+				auto c = peek(cid, eid);
+				if (type == nullptr || c == nullptr)
+					return false;
+				for (uint64_t r = 0; r < runs && !in.failed; ++r)
+				{
+					auto offset = in.varint();
+					auto n = in.varint();
+					auto data = in.bytes(n);
+					if (in.failed || offset + n > type->dataSize)
+						return false;
+					memcpy(Type::data(c) + offset, data, n);
+				}
+				changed(cid, eid);
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	return !in.failed;
+}
+
+//
+// Hashing
+//
+
+static inline uint64_t rotl(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL, kPrime2 = 0xC2B2AE3D27D4EB4FULL, kPrime3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t round64(uint64_t lane, uint64_t word)
+{
+	return rotl(lane + word * kPrime2, 31) * kPrime1;
+}
+
+/// Hash bytes in four independent 64-bit lanes, in the style of xxHash64,
+/// so the main loop has no dependency between lanes and can be vectorized.
+static uint64_t hashBytes(const char* p, size_t n, uint64_t seed)
+{
+	uint64_t lanes[4] = {seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1};
+	auto end = p + n;
+	for (; p + 32 <= end; p += 32)
+	{
+		uint64_t words[4];
+		memcpy(words, p, sizeof(words));
+		for (unsigned i = 0; i < 4; ++i)
+			lanes[i] = round64(lanes[i], words[i]);
+	}
+	auto h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + n;
+	for (; p + 8 <= end; p += 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		h = rotl(h ^ round64(0, word), 27) * kPrime1 + kPrime3;
+	}
+	for (; p < end; ++p)
+		h = rotl(h ^ ((uint8_t)*p * kPrime1), 11) * kPrime2;
+	h ^= h >> 33;
+	h *= kPrime2;
+	h ^= h >> 29;
+	h *= kPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+/// Hash the Eids and data of the components in one 64-entity chunk.
+uint64_t Entity::World::hashChunk(Cid cid, unsigned w, unsigned dataSize)
+{
+	auto word = componentBits[cid].words[w];
+	if (word == 0)
+		return 0;
+	auto& buffer = hashBuffer;
+	buffer.clear();
+	for (; word != 0; word &= word - 1)
+	{
+		Eid eid = (w << 6) + Entity::Bitset::ctz(word);
+		auto data = Entity::Type::data(components[cid][eid]);
+		putBytes(buffer, reinterpret_cast<const char*>(&eid), sizeof(eid));
+		putBytes(buffer, data, dataSize);
+	}
+	return hashBytes(buffer.data(), buffer.size(), cid);
+}
+
+uint64_t Entity::World::worldHash(const vector<Cid>& cids, bool incremental)
+{
+	alloc();
+	vector<uint64_t> hashes;
+	hashes.push_back(hashBytes(reinterpret_cast<const char*>(entities->words), sizeof(entities->words), 0));
+
+	for (Cid cid = 0; cid < Component::numCids; ++cid)
+	{
+		auto type = Entity::getType(cid);
+		if (type == nullptr || !type->plain)
+			continue;
+		if (!cids.empty() && find(cids.begin(), cids.end(), cid) == cids.end())
+			continue;
+
+		auto& chunks = chunkHashes[cid];
+		auto& dirtyWords = dirtyChunks[cid];
+		for (unsigned s = 0; s < Bitset::kSummaryWords; ++s)
+		{
+			if (incremental)
+			{
+				for (auto bits = dirtyWords[s]; bits != 0; bits &= bits - 1)
+				{
+					auto w = (s << 6) + Bitset::ctz(bits);
+					if (w < Bitset::kWords)
+						chunks[w] = hashChunk(cid, w, type->dataSize);
+				}
+			}
+			else
+			{
+				auto last = min((s + 1) << 6, (unsigned)Bitset::kWords);
+				for (auto w = s << 6; w < last; ++w)
+					chunks[w] = hashChunk(cid, w, type->dataSize);
+			}
+			dirtyWords[s] = 0;
+		}
+		hashes.push_back(hashBytes(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(uint64_t), cid));
+	}
+	return hashBytes(reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(uint64_t), 0);
+}
+
+//
+// Entity::History
+//
+
+Entity::History::History(unsigned capacity, World& world) :
+	world(&world),
+	frames(capacity > 0 ? capacity : 1),
+	head(0),
+	count(0),
+	last(0),
+	synced(false)
+{
+	if (world.history != nullptr)
+		Assert(false, "The world already has a history");
+	world.history = this;
+}
+
+Entity::History::~History()
+{
+	if (world != nullptr && world->history == this)
+		world->history = nullptr;
+}
+
+void Entity::History::touch(Eid eid)
+{
+	if (!synced || eid >= kMaxEntities)
+		return;
+	auto bit = uint64_t(1) << (eid & 63);
+	if (touchedEntities[eid >> 6] & bit)
+		return;
+	touchedEntities[eid >> 6] |= bit;
+	entityList.push_back(eid);
+}
+
+void Entity::History::touch(Cid cid, Eid eid)
+{
+	if (!synced || eid >= kMaxEntities)
+		return;
+	auto type = Entity::getType(cid);
+	if (type == nullptr || !type->plain)
+		return;
+
+	// a class's copy is set up the first time one of its components is touched
+	if (cid >= pools.size())
+		pools.resize(cid + 1);
+	auto& pool = pools[cid];
+	if (pool.slots.empty())
+	{
+		pool.dataSize = type->dataSize;
+		pool.slots.assign(kMaxEntities, 0);
+		pool.touched.assign(Bitset::kWords, 0);
+	}
+	auto bit = uint64_t(1) << (eid & 63);
+	if (pool.touched[eid >> 6] & bit)
+		return;
+	pool.touched[eid >> 6] |= bit;
+	componentList.push_back(make_pair(cid, eid));
+}
+
+void Entity::History::undo(vector<char>& out)
+{
+	// the same three passes over entities as `Entity::diff`, from the world to the copy, but only over what was touched
+	out.clear();
+	putBytes(out, deltaMagic, sizeof(deltaMagic));
+	auto parentNow = [this](Eid eid) -> Eid {return world->exists(eid) ? world->links[eid].parent : 0;};
+	auto parentThen = [this](Eid eid) -> Eid {return wasLive(eid) ? parents[eid] : 0;};
+	for (auto eid : entityList)
+	{
+		if (world->exists(eid) && wasLive(eid) && parentNow(eid) != 0 && parentNow(eid) != parentThen(eid))
+		{
+			out.push_back(kDeltaParent);
+			putVarint(out, eid);
+			putVarint(out, 0);
+		}
+	}
+	for (auto eid : entityList)
+	{
+		auto is = world->exists(eid), was = wasLive(eid);
+		if (is != was)
+		{
+			out.push_back(was ? kDeltaCreate : kDeltaDestroy);
+			putVarint(out, eid);
+		}
+	}
+	for (auto eid : entityList)
+	{
+		auto parent = parentThen(eid);
+		if (parent != 0 && (parent != parentNow(eid) || !world->exists(eid)))
+		{
+			out.push_back(kDeltaParent);
+			putVarint(out, eid);
+			putVarint(out, parent);
+		}
+	}
+
+	for (auto& touched : componentList)
+	{
+		auto cid = touched.first;
+		auto eid = touched.second;
+		auto& pool = pools[cid];
+		auto c = world->exists(eid) ? world->peek(cid, eid) : nullptr;
+		auto slot = pool.slots[eid];
+		if (slot == 0)
+		{
+			// added since, unless the whole entity is going
+			if (c != nullptr && wasLive(eid))
+			{
+				out.push_back(kDeltaRemove);
+				putVarint(out, cid);
+				putVarint(out, eid);
+			}
+			continue;
+		}
+		auto then = pool.data.data() + (size_t)(slot - 1) * pool.dataSize;
+		if (c == nullptr)
+		{
+			out.push_back(kDeltaAdd);
+			putVarint(out, cid);
+			putVarint(out, eid);
+			putVarint(out, pool.dataSize);
+			putBytes(out, then, pool.dataSize);
+		}
+		else
+			putPatch(out, cid, eid, Type::data(c), then, pool.dataSize);
+	}
+	out.push_back(kDeltaEnd);
+}
+
+void Entity::History::sync()
+{
+	for (auto eid : entityList)
+	{
+		auto bit = uint64_t(1) << (eid & 63);
+		if (world->exists(eid))
+			live[eid >> 6] |= bit;
+		else
+			live[eid >> 6] &= ~bit;
+		parents[eid] = world->exists(eid) ? world->links[eid].parent : 0;
+		touchedEntities[eid >> 6] &= ~bit;
+	}
+	entityList.clear();
+
+	for (auto& touched : componentList)
+	{
+		auto cid = touched.first;
+		auto eid = touched.second;
+		auto& pool = pools[cid];
+		auto& slot = pool.slots[eid];
+		auto c = world->exists(eid) ? world->peek(cid, eid) : nullptr;
+		if (c != nullptr)
+		{
+			if (slot == 0)
+			{
+				if (!pool.free.empty())
+				{
+					slot = pool.free.back();
+					pool.free.pop_back();
+				}
+				else
+				{
+					pool.data.resize(pool.data.size() + pool.dataSize);
+					slot = (unsigned)(pool.data.size() / pool.dataSize);
+				}
+			}
+			memcpy(pool.data.data() + (size_t)(slot - 1) * pool.dataSize, Type::data(c), pool.dataSize);
+		}
+		else if (slot != 0)
+		{
+			pool.free.push_back(slot);
+			slot = 0;
+		}
+		pool.touched[eid >> 6] &= ~(uint64_t(1) << (eid & 63));
+	}
+	componentList.clear();
+}
+
+void Entity::History::syncAll()
+{
+	// start the copy over by touching everything
+	world->alloc();
+	live.assign(Bitset::kWords, 0);
+	parents.assign(kMaxEntities, 0);
+	touchedEntities.assign(Bitset::kWords, 0);
+	entityList.clear();
+	componentList.clear();
+	for (auto& pool : pools)
+	{
+		fill(pool.slots.begin(), pool.slots.end(), 0);
+		fill(pool.touched.begin(), pool.touched.end(), 0);
+		pool.data.clear();
+		pool.free.clear();
+	}
+	synced = true;
+	world->entities->each([this](Eid eid) {touch(eid);});
+	for (Cid cid = 0; cid < Component::numCids; ++cid)
+		for (auto eid : world->componentEids[cid])
+			touch(cid, eid);
+	sync();
+}
+
+void Entity::History::save(unsigned tick)
+{
+	if (world == nullptr)
+		return;
+	Profiler::Scope scope(world->getProfiler(), "History::save");
+	if (!synced)
+		syncAll();
+	else
+	{
+		// the undo delta leads from this tick back to the previous one
+		auto& frame = frames[head];
+		frame.tick = last;
+		undo(frame.undo);
+		sync();
+		head = (head + 1) % frames.size();
+		count = min(count + 1, (unsigned)frames.size());
+	}
+	last = tick;
+}
+
+bool Entity::History::has(unsigned tick) const
+{
+	if (!synced)
+		return false;
+	if (tick == last)
+		return true;
+	for (unsigned i = 0; i < count; ++i)
+		if (frames[(head + frames.size() - 1 - i) % frames.size()].tick == tick)
+			return true;
+	return false;
+}
+
+bool Entity::History::restore(unsigned tick)
+{
+	if (world == nullptr || !has(tick))
+		return false;
+	Profiler::Scope scope(world->getProfiler(), "History::restore");
+
+	// first undo anything which happened since the last save
+	undo(delta);
+	if (!world->apply(delta.data(), delta.size()))
+		return false;
+
+	// then step back one tick at a time
+	while (last != tick)
+	{
+		head = (head + frames.size() - 1) % frames.size();
+		count--;
+		auto& frame = frames[head];
+		if (!world->apply(frame.undo.data(), frame.undo.size()))
+			return false;
+		last = frame.tick;
+	}
+
+	// everything the deltas touched is brought back in line with the restored world
+	sync();
+	LogV(defaultVerbosity, 1, "Restored tick %u", tick);
+	return true;
+}
+
+void Entity::History::clear()
+{
+	synced = false;
+	entityList.clear();
+	componentList.clear();
+	head = count = last = 0;
+}
+
+//
+// Entity::Spawner
+//
+
+/// Eids are reserved from the world this many at a time.
+static const unsigned kSpawnerBlock = 64;
+
+Entity::Spawner::Spawner(World& world) :
+	world(&world)
+{
+	world.alloc();
+}
+
+Entity::Spawner::~Spawner()
+{
+	for (auto& staged : components)
+		delete staged.c;
+	// uncommitted Eids go back to the world, which must look for free Eids from the lowest of them again
+	for (auto eid : created)
+	{
+		world->release(eid);
+		world->firstFree = min(world->firstFree, eid);
+	}
+	for (auto eid : reserved)
+	{
+		world->release(eid);
+		world->firstFree = min(world->firstFree, eid);
+	}
+}
+
+Eid Entity::Spawner::create()
+{
+	if (reserved.empty())
+	{
+		Eid block[kSpawnerBlock];
+		auto n = world->reserve(block, kSpawnerBlock);
+		
+		// hand out the lowest Eids first
+		for (unsigned i = n; i > 0; --i)
+			reserved.push_back(block[i - 1]);
+	}
+	if (reserved.empty())
+		return 0;
+	auto eid = reserved.back();
+	reserved.pop_back();
+	created.push_back(eid);
+	return eid;
+}
+
+void Entity::Spawner::addComponent(Cid cid, Eid eid, Component* c)
+{
+	if (c != nullptr)
+		components.push_back(Staged{cid, eid, c});
+}
+
+void Entity::Spawner::destroy(Eid eid)
+{
+	destroyed.push_back(eid);
+}
+
+void Entity::Spawner::commit()
+{
+	Profiler::Scope scope(world->profiler, "Spawner::commit");
+	world->profiler.processed((unsigned)created.size());
+	for (auto eid : created)
+		world->revive(eid);
+	for (auto& staged : components)
+		world->addComponent(staged.cid, staged.eid, staged.c);
+	for (auto eid : destroyed)
+		if (world->exists(eid))
+			world->destroyNow(eid);
+	LogV(defaultVerbosity, 1, "Spawner committed %u entities, %u components, %u destructions",
+		(unsigned)created.size(), (unsigned)components.size(), (unsigned)destroyed.size());
+	created.clear();
+	components.clear();
+	destroyed.clear();
+}
+
+//
+// Entity::Prefab
+//
+
+Entity::Prefab::Prefab()
+{
+}
+
+Entity::Prefab::Prefab(Eid eid, World& world)
+{
+	if (!world.exists(eid))
+		return;
+
+	// prototypes may outlive the world, so they never come from its arena
+	AllocateFrom allocating(nullptr);
+	for (Cid cid = 0; cid < Component::numCids; cid++)
+	{
+		auto c = world.peek(cid, eid);
+		if (c == nullptr)
+			continue;
+		auto type = Entity::getType(cid);
+		if (type == nullptr)
+		{
+			Assert(false, "Prefab component cid %u has not been described", cid);
+			continue;
+		}
+		parts.push_back(Part{cid, type->clone(c)});
+	}
+}
+
+Entity::Prefab::~Prefab()
+{
+	for (auto& part : parts)
+		delete part.c;
+}
+
+void Entity::Prefab::add(Cid cid, Component* c)
+{
+	if (c == nullptr)
+		return;
+	if (Entity::getType(cid) == nullptr)
+	{
+		Assert(false, "Prefab component cid %u has not been described", cid);
+		delete c;
+		return;
+	}
+	for (auto& part : parts)
+	{
+		if (part.cid == cid)
+		{
+			delete part.c;
+			part.c = c;
+			return;
+		}
+	}
+	parts.push_back(Part{cid, c});
+}
+
+//
+// Entity::Recorder
+//
+
+/// Buffered calls are written to the file in chunks of about this many bytes.
+static const size_t kRecorderChunk = 1 << 20;
+
+Entity::Recorder::Recorder(const char* path, World& world) :
+	world(&world),
+	file(fopen(path, "wb"))
+{
+	if (file == nullptr)
+		return;
+
+	// header: magic, version, maximum entities and number of component classes
+	uint32_t header[4] = {0x43524645, kVersion, kMaxEntities, Component::numCids};
+	fwrite(header, sizeof(header), 1, file);
+	buffer.reserve(kRecorderChunk + 32);
+	world.recorder = this;
+}
+
+Entity::Recorder::~Recorder()
+{
+	if (world != nullptr && world->recorder == this)
+		world->recorder = nullptr;
+	if (file != nullptr)
+	{
+		flush();
+		fclose(file);
+	}
+}
+
+void Entity::Recorder::flush()
+{
+	if (file != nullptr && !buffer.empty())
+		fwrite(buffer.data(), buffer.size(), 1, file);
+	buffer.clear();
+}
+
+void Entity::Recorder::record(unsigned op, Cid cid, Eid eid, unsigned size)
+{
+	// an opcode then varints, leaving out the fields an opcode does not use
+	buffer.push_back((char)op);
+	if (op != Create && op != Destroy)
+		putVarint(buffer, cid);
+	if (op != GetAll && op != GetComponents)
+		putVarint(buffer, eid);
+	if (op == Add)
+		putVarint(buffer, size);
+	if (buffer.size() >= kRecorderChunk)
+		flush();
+}
+
+//
+// Entity::Telemetry
+//
+
+bool Entity::TelemetryPage::read(const TelemetryPage* page, TelemetryPage& out)
+{
+	if (page == nullptr || page->magic != kMagic || page->version != kVersion)
+		return false;
+
+	// retry while the writer is mid-update, but not forever: a publisher which died mid-update leaves the sequence odd
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(kReadTimeout);
+	while (chrono::steady_clock::now() < deadline)
+	{
+		auto before = page->sequence.load(memory_order_acquire);
+		if (before & 1)
+		{
+			this_thread::yield();
+			continue;
+		}
+		memcpy(reinterpret_cast<char*>(&out) + offsetof(TelemetryPage, numCids),
+			reinterpret_cast<const char*>(page) + offsetof(TelemetryPage, numCids),
+			sizeof(TelemetryPage) - offsetof(TelemetryPage, numCids));
+		atomic_thread_fence(memory_order_acquire);
+		if (page->sequence.load(memory_order_relaxed) == before)
+		{
+			// the page is shared memory which another process may have scribbled on
+			out.magic = page->magic;
+			out.version = page->version;
+			out.sequence.store(before, memory_order_relaxed);
+			out.numCids = min(out.numCids, (uint32_t)kMaxCids);
+			out.numSystems = min(out.numSystems, (uint32_t)kMaxSystems);
+			for (unsigned i = 0; i < out.numSystems; ++i)
+				out.systems[i].name[kNameSize - 1] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+Entity::Telemetry::Telemetry(const char* name, World& world) :
+	world(&world),
+	page(nullptr),
+	tick(0),
+	memory()
+{
+	snprintf(this->name, sizeof(this->name), "%s", name);
+#ifndef _WIN32
+	auto fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		return;
+	if (ftruncate(fd, sizeof(TelemetryPage)) == 0)
+	{
+		auto p = mmap(nullptr, sizeof(TelemetryPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED)
+			page = static_cast<TelemetryPage*>(p);
+	}
+	::close(fd);
+	if (page == nullptr)
+	{
+		shm_unlink(name);
+		return;
+	}
+
+	// a process which died while publishing can leave its segment behind with an odd sequence
+	memset(static_cast<void*>(page), 0, sizeof(TelemetryPage));
+	page->magic = TelemetryPage::kMagic;
+	page->version = TelemetryPage::kVersion;
+	world.telemetry = this;
+#endif
+}
+
+Entity::Telemetry::~Telemetry()
+{
+#ifndef _WIN32
+	if (page != nullptr)
+	{
+		munmap(page, sizeof(TelemetryPage));
+		shm_unlink(name);
+	}
+#endif
+	if (world != nullptr && world->telemetry == this)
+		world->telemetry = nullptr;
+}
+
+void Entity::Telemetry::publish()
+{
+	if (page == nullptr || world == nullptr)
+		return;
+
+	// gather first so the page is odd for as short a time as possible
+	auto& profiler = world->getProfiler();
+	auto& stats = profiler.getStats();
+	if (tick % kMemoryInterval == 0)
+		world->memoryStats(memory);
+	auto numCids = min((unsigned)Component::numCids, (unsigned)TelemetryPage::kMaxCids);
+	auto numSystems = min((unsigned)stats.size(), (unsigned)TelemetryPage::kMaxSystems);
+
+	auto sequence = page->sequence.load(memory_order_relaxed);
+	page->sequence.store(sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	page->numCids = numCids;
+	page->tick = ++tick;
+	page->memoryBytes = memory.totalBytes;
+	page->entities = world->count();
+	page->numSystems = numSystems;
+	for (Cid cid = 0; cid < numCids; ++cid)
+		page->populations[cid] = world->count(cid);
+	for (unsigned i = 0; i < numSystems; ++i)
+	{
+		auto& system = page->systems[i];
+		snprintf(system.name, sizeof(system.name), "%s", stats[i].name);
+		system.calls = stats[i].calls;
+		system.entities = stats[i].entities;
+		system.last = stats[i].last;
+		system.p50 = stats[i].p50;
+		system.p99 = stats[i].p99;
+	}
+
+	page->sequence.store(sequence + 2, memory_order_release);
+}
+
+const Entity::TelemetryPage* Entity::Telemetry::open(const char* name)
+{
+#ifndef _WIN32
+	auto fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+	struct stat info;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(TelemetryPage))
+		p = mmap(nullptr, sizeof(TelemetryPage), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p != MAP_FAILED)
+		return static_cast<const TelemetryPage*>(p);
+#endif
+	return nullptr;
+}
+
+void Entity::Telemetry::close(const TelemetryPage* page)
+{
+#ifndef _WIN32
+	if (page != nullptr)
+		munmap(const_cast<TelemetryPage*>(page), sizeof(TelemetryPage));
+#endif
+}
+
+//
+// Entity::Histogram
+//
+
+Entity::Histogram::Histogram() :
+	numValues(0),
+	lowest(0),
+	highest(0),
+	sum(0)
+{
+}
+
+unsigned Entity::Histogram::bucket(uint64_t value)
+{
+	// values below 2^kSubBits have a bucket each
+	if (value < (1u << kSubBits))
+		return (unsigned)value;
+
+	// above that each power of two is split into 2^(kSubBits-1) buckets
+	auto bit = highestBit(value);
+	if (bit >= kMaxBits)
+		return kBuckets - 1;
+	auto shift = bit - (kSubBits - 1);
+	return ((bit - kSubBits + 2) << (kSubBits - 1)) + (unsigned)(value >> shift) - (1u << (kSubBits - 1));
+}
+
+uint64_t Entity::Histogram::highestEquivalent(unsigned bucket)
+{
+	if (bucket < (1u << kSubBits))
+		return bucket;
+	auto shift = (bucket >> (kSubBits - 1)) - 1;
+	auto sub = bucket & ((1u << (kSubBits - 1)) - 1);
+	return ((uint64_t((1u << (kSubBits - 1)) + sub) + 1) << shift) - 1;
+}
+
+void Entity::Histogram::record(uint64_t nanoseconds)
+{
+	if (counts.empty())
+		counts.resize(kBuckets, 0);
+	counts[bucket(nanoseconds)]++;
+	if (numValues == 0 || nanoseconds < lowest)
+		lowest = nanoseconds;
+	if (nanoseconds > highest)
+		highest = nanoseconds;
+	numValues++;
+	sum += (double)nanoseconds;
+}
+
+uint64_t Entity::Histogram::percentile(double percent) const
+{
+	if (numValues == 0)
+		return 0;
+
+	// the rank of the value wanted, counting from 1
+	auto rank = (uint64_t)ceil(numValues * min(max(percent, 0.0), 100.0) / 100.0);
+	rank = max(rank, (uint64_t)1);
+	if (rank >= numValues)
+		return highest;
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < kBuckets; ++b)
+	{
+		seen += counts[b];
+		if (seen >= rank)
+			return max(min(highestEquivalent(b), highest), lowest);
+	}
+	return highest;
+}
+
+double Entity::Histogram::mean() const
+{
+	return numValues > 0 ? sum / numValues : 0;
+}
+
+void Entity::Histogram::reset()
+{
+	fill(counts.begin(), counts.end(), 0);
+	numValues = 0;
+	lowest = 0;
+	highest = 0;
+	sum = 0;
+}
+
+void Entity::Histogram::merge(const Histogram& other)
+{
+	if (other.numValues == 0)
+		return;
+	if (counts.empty())
+		counts.resize(kBuckets, 0);
+	for (unsigned b = 0; b < kBuckets; ++b)
+		counts[b] += other.counts[b];
+	lowest = numValues > 0 ? min(lowest, other.lowest) : other.lowest;
+	highest = max(highest, other.highest);
+	numValues += other.numValues;
+	sum += other.sum;
+}
+
+//
+// Entity::NoAllocations
+//
+
+Entity::NoAllocations::~NoAllocations()
+{
+	// checked in every build, and never thrown from a destructor
+	auto n = count();
+	if (n > 0)
+	{
+		fprintf(stderr, "%s made %llu allocations inside a NoAllocations region\n", name, (unsigned long long)n);
+		abort();
+	}
+}
+
+//
+// Entity::Arena
+//
+
+Entity::Arena::Arena(size_t chunkSize) :
+	chunkSize(chunkSize),
+	offset(0),
+	usedBytes(0)
+{
+}
+
+Entity::Arena::~Arena()
+{
+	for (auto& chunk : chunks)
+		::operator delete(chunk.data);
+}
+
+void* Entity::Arena::allocate(size_t size, size_t align)
+{
+	if (!chunks.empty())
+	{
+		auto& chunk = chunks.back();
+		auto base = (uintptr_t)chunk.data;
+		auto start = (size_t)(((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base);
+		if (start + size <= chunk.size)
+		{
+			offset = start + size;
+			usedBytes += size;
+			return chunk.data + start;
+		}
+	}
+
+	// start a new chunk, big enough for an oversized request
+	auto bytes = max(chunkSize, size + align);
+	chunks.push_back(Chunk{static_cast<char*>(::operator new(bytes)), bytes});
+	countAllocation();
+	auto start = ((uintptr_t)chunks.back().data + align - 1) & ~(uintptr_t)(align - 1);
+	offset = start - (uintptr_t)chunks.back().data + size;
+	usedBytes += size;
+	return reinterpret_cast<char*>(start);
+}
+
+void Entity::Arena::reset()
+{
+	for (size_t i = 1; i < chunks.size(); ++i)
+		::operator delete(chunks[i].data);
+	if (chunks.size() > 1)
+		chunks.resize(1);
+	offset = 0;
+	usedBytes = 0;
+}
+
+size_t Entity::Arena::reserved() const
+{
+	size_t bytes = 0;
+	for (auto& chunk : chunks)
+		bytes += chunk.size;
+	return bytes;
+}
+
+//
+// Entity::Profiler
+//
+
+/// Seconds on a monotonic clock.
+static double seconds()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Entity::Profiler::Profiler() :
+	enabled(false),
+	epoch(seconds()),
+	counting(false),
+	counterLeader(-1),
+	numCounterSlots(0)
+{
+	for (unsigned i = 0; i < kCounters; ++i)
+	{
+		counterFds[i] = -1;
+		counterSlots[i] = -1;
+	}
+}
+
+Entity::Profiler::~Profiler()
+{
+	enableCounters(false);
+}
+
+void Entity::Profiler::enable(bool on)
+{
+	enabled = on;
+}
+
+bool Entity::Profiler::enableCounters(bool on)
+{
+	// close any open counters
+	for (unsigned i = 0; i < kCounters; ++i)
+	{
+#ifdef __linux__
+		if (counterFds[i] >= 0)
+			close(counterFds[i]);
+#endif
+		counterFds[i] = -1;
+		counterSlots[i] = -1;
+	}
+	counterLeader = -1;
+	numCounterSlots = 0;
+	counting = false;
+	if (!on)
+		return true;
+
+#ifdef __linux__
+	// open each counter into one group led by the first which opens, so one read returns them all
+	static const uint32_t types[kCounters] =
+		{PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+	static const uint64_t configs[kCounters] =
+	{
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+	for (unsigned i = 0; i < kCounters; ++i)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[i];
+		attr.config = configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		auto fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, counterLeader, 0);
+		if (fd < 0)
+			continue;
+		if (counterLeader < 0)
+			counterLeader = fd;
+		counterFds[i] = fd;
+		counterSlots[i] = (int)numCounterSlots++;
+	}
+	counting = counterLeader >= 0;
+#endif
+	LogV(defaultVerbosity, 1, "Profiler opened %u hardware counters", numCounterSlots);
+	return counting;
+}
+
+void Entity::Profiler::readCounters(uint64_t out[kCounters])
+{
+	uint64_t values[1 + kCounters] = {};
+#ifdef __linux__
+	if (read(counterLeader, values, sizeof(values)) <= 0)
+		values[0] = 0;
+#endif
+	for (unsigned i = 0; i < kCounters; ++i)
+		out[i] = counterSlots[i] >= 0 && (uint64_t)counterSlots[i] < values[0] ? values[1 + counterSlots[i]] : 0;
+}
+
+void Entity::Profiler::begin(const char* name, const vector<Cid>* cids)
+{
+	// names are usually literals, so compare pointers before strings
+	unsigned stat = 0;
+	while (stat < stats.size() && stats[stat].name != name && strcmp(stats[stat].name, name) != 0)
+		++stat;
+	if (stat == stats.size())
+	{
+		stats.push_back(Stats{name, 0, 0, 0, 0, 0, 0, vector<double>(), {}, vector<Cid>(), Histogram(), 0, 0});
+		if (cids != nullptr)
+			stats.back().cids = *cids;
+	}
+	open.push_back(Open{stat, 0, 0, {}, 0});
+
+	// read last so that the profiler's own bookkeeping is not counted against the scope
+	open.back().allocations = allocationCount;
+	if (counting)
+		readCounters(open.back().counters);
+	open.back().start = seconds();
+}
+
+void Entity::Profiler::end()
+{
+	if (open.empty())
+		return;
+	auto now = seconds();
+	auto allocations = allocationCount;
+	auto& scope = open.back();
+	auto& stat = stats[scope.stat];
+	if (counting)
+	{
+		uint64_t counters[kCounters];
+		readCounters(counters);
+		for (unsigned i = 0; i < kCounters; ++i)
+			stat.counters[i] += counters[i] - scope.counters[i];
+	}
+
+	auto duration = now - scope.start;
+	if (stat.recent.size() < kWindow)
+		stat.recent.push_back(duration);
+	else
+		stat.recent[stat.calls % kWindow] = duration;
+	stat.calls++;
+	stat.entities = scope.entities;
+	stat.last = duration;
+	stat.total += duration;
+	stat.histogram.recordSeconds(duration);
+	stat.lastAllocations = allocations - scope.allocations;
+	stat.allocations += stat.lastAllocations;
+
+	if (events.size() < kMaxEvents)
+		events.push_back(Event{scope.stat, (unsigned)open.size() - 1, scope.start - epoch, duration, scope.entities});
+	open.pop_back();
+}
+
+const Entity::Histogram* Entity::Profiler::getHistogram(const char* name) const
+{
+	for (auto& stat : stats)
+		if (stat.name == name || strcmp(stat.name, name) == 0)
+			return &stat.histogram;
+	return nullptr;
+}
+
+void Entity::Profiler::resetHistograms()
+{
+	for (auto& stat : stats)
+		stat.histogram.reset();
+}
+
+void Entity::Profiler::getPoolCounters(Cid cid, uint64_t out[kCounters]) const
+{
+	for (unsigned i = 0; i < kCounters; ++i)
+		out[i] = 0;
+	for (auto& stat : stats)
+	{
+		if (find(stat.cids.begin(), stat.cids.end(), cid) == stat.cids.end())
+			continue;
+		for (unsigned i = 0; i < kCounters; ++i)
+			out[i] += stat.counters[i] / stat.cids.size();
+	}
+}
+
+const vector<Entity::Profiler::Stats>& Entity::Profiler::getStats()
+{
+	for (auto& stat : stats)
+	{
+		if (stat.recent.empty())
+			continue;
+		sorted = stat.recent;
+		sort(sorted.begin(), sorted.end());
+		stat.p50 = sorted[sorted.size() / 2];
+		stat.p99 = sorted[min(sorted.size() - 1, sorted.size() * 99 / 100)];
+	}
+	return stats;
+}
+
+bool Entity::Profiler::writeTrace(const char* path) const
+{
+	auto file = fopen(path, "w");
+	if (file == nullptr)
+		return false;
+
+	// complete events, in microseconds
+	fprintf(file, "{\"traceEvents\":[");
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		auto& event = events[i];
+		fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"entities\":%u,\"depth\":%u}}",
+			i > 0 ? "," : "", stats[event.stat].name, event.start * 1e6, event.duration * 1e6, event.entities, event.depth);
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	return fclose(file) == 0;
+}
+
+size_t Entity::Profiler::memoryUsed() const
+{
+	auto bytes = stats.capacity() * sizeof(Stats) + open.capacity() * sizeof(Open) +
+		events.capacity() * sizeof(Event) + sorted.capacity() * sizeof(double);
+	for (auto& stat : stats)
+		bytes += stat.recent.capacity() * sizeof(double) + stat.histogram.memoryUsed();
+	return bytes;
+}
+
+void Entity::Profiler::reset()
+{
+	stats.clear();
+	open.clear();
+	events.clear();
+	epoch = seconds();
+}
+
+//
+// Entity::Bitset
+//
+
+void Entity::Bitset::reset()
+{
+	for (unsigned w = 0; w < kWords; ++w)
+		words[w] = 0;
+	for (unsigned s = 0; s < kSummaryWords; ++s)
+		summary[s] = 0;
+}
+
+unsigned Entity::Bitset::count() const
+{
+	unsigned ret = 0;
+	for (unsigned s = 0; s < kSummaryWords; ++s)
+		for (auto bits = summary[s]; bits != 0; bits &= bits - 1)
+			ret += popcount(words[(s << 6) + ctz(bits)]);
+	return ret;
+}
+
+void Entity::Bitset::intersect(Bitset& out, const Bitset& a, const Bitset& b)
+{
+	for (unsigned s = 0; s < kSummaryWords; ++s)
+	{
+		auto bits = a.summary[s] & b.summary[s];
+		auto first = s << 6;
+		auto last = min(first + 64, (unsigned)kWords);
+		if (bits == 0)
+		{
+			for (auto w = first; w < last; ++w)
+				out.words[w] = 0;
+		}
+		else
+		{
+			// straight-line AND which the compiler can vectorize
+			for (auto w = first; w < last; ++w)
+				out.words[w] = a.words[w] & b.words[w];
+			bits = 0;
+			for (auto w = first; w < last; ++w)
+				bits |= uint64_t(out.words[w] != 0) << (w - first);
+		}
+		out.summary[s] = bits;
+	}
+}
+
+//
+// Entity::Component
+//
+
+Entity::Component::~Component()
+{
+}
+
+bool Entity::Component::full() const
+{
+	return !this->empty();
+}
+
+void* Entity::Component::operator new(size_t size)
+{
+	auto arena = allocatingArena;
+	unsigned sizeClass = 0;
+	Allocation* allocation;
+	if (arena != nullptr)
+		allocation = static_cast<Allocation*>(arena->allocate(sizeof(Allocation) + size, alignof(Allocation)));
+	else if (pooling.load(memory_order_relaxed) && (sizeClass = poolClass(sizeof(Allocation) + size)) != 0)
+		allocation = static_cast<Allocation*>(poolAllocate(sizeClass));
+	else
+	{
+		countAllocation();
+		allocation = static_cast<Allocation*>(::operator new(sizeof(Allocation) + size));
+	}
+	allocation->arena = arena;
+	allocation->sizeClass = sizeClass;
+	auto p = allocation + 1;
+	memset(p, 0, size);
+	return p;
+}
+
+void Entity::Component::operator delete(void* p)
+{
+	if (p == nullptr)
+		return;
+
+	// arena memory is released with the arena, and pooled memory goes back to a free list
+	auto allocation = static_cast<Allocation*>(p) - 1;
+	if (allocation->arena != nullptr)
+		return;
+	if (allocation->sizeClass != 0)
+		poolFree(allocation->sizeClass, allocation);
+	else
+		::operator delete(allocation);
+}
+
+//
+// Entity::Listener
+//
+
+Entity::Listener::~Listener()
+{
+}
+
+//
+// System
+//
+
+/// A system registered with `System::add`.
+struct RegisteredSystem
+{
+	const char* name;
+	const char* animateName;
+	void (*tick)(double);
+	void (*animate)(double, double);
+	vector<Cid> cids;
+};
+
+/// Registered systems, constructed on first use so systems can be added during static initialization.
+static vector<RegisteredSystem>& registeredSystems()
+{
+	static vector<RegisteredSystem> systems;
+	return systems;
+}
+
+void System::tick(double fixedDelta)
+{
+	auto& world = Entity::getWorld();
+	auto& profiler = world.getProfiler();
+	{
+		Entity::Profiler::Scope frame(profiler, "System::tick");
+		for (auto& system : registeredSystems())
+		{
+			if (system.tick == nullptr)
+				continue;
+			Entity::Profiler::Scope scope(profiler, system.name, &system.cids);
+			system.tick(fixedDelta);
+		}
+	}
+	if (world.getTelemetry() != nullptr)
+		world.getTelemetry()->publish();
+}
+
+void System::animate(double delta, double tickPercent)
+{
+	auto& profiler = Entity::getProfiler();
+	Entity::Profiler::Scope frame(profiler, "System::animate");
+	for (auto& system : registeredSystems())
+	{
+		if (system.animate == nullptr)
+			continue;
+		Entity::Profiler::Scope scope(profiler, system.animateName, &system.cids);
+		system.animate(delta, tickPercent);
+	}
+}
+
+void System::add(const char* name, void (*tick)(double), void (*animate)(double, double), const vector<Cid>& cids)
+{
+	// a system class without its own functions inherits these, which would recurse
+	if (tick == &System::tick)
+		tick = nullptr;
+	if (animate == &System::animate)
+		animate = nullptr;
+
+	// animation is timed separately, under a name which lives as long as the registry
+	static deque<string> animateNames;
+	animateNames.push_back(string(name) + ".animate");
+	registeredSystems().push_back(RegisteredSystem{name, animateNames.back().c_str(), tick, animate, cids});
 }
 
 
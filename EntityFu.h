@@ -6,6 +6,16 @@
 
 #pragma once
 #include <vector>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
 
 /// An `Eid` is an entity ID.
 typedef unsigned Eid;
@@ -16,9 +26,41 @@ typedef unsigned Cid;
 namespace Entity
 {
 	struct Component;
+	struct Listener;
+	struct Type;
+	class Bitset;
+	class Snapshot;
+	class History;
+	class World;
+	class Spawner;
+	class Prefab;
+	class Histogram;
+	class NoAllocations;
+	class Arena;
+	class Profiler;
+	struct MemoryStats;
+	struct TraceEvent;
+	class Recorder;
+	struct TelemetryPage;
+	class Telemetry;
 
-	/// The maximum number of entities. Increase this if you need more.
-	enum {kMaxEntities = 8192};
+	/// The largest component, in bytes, which `useComponentPools` recycles.
+	enum {kMaxPooledComponent = 1008};
+
+	/// The maximum number of entities. Increase this if you need more,
+	/// either here or by defining `EntityFu_MaxEntities` when compiling.
+#ifndef EntityFu_MaxEntities
+	#define EntityFu_MaxEntities 8192
+#endif
+	enum {kMaxEntities = EntityFu_MaxEntities};
+
+	/// Return the world which the functions below operate on for the current thread.
+	/// This is a default world unless `setWorld` has been called on this thread.
+	World& getWorld();
+
+	/// Make the functions below operate on the given world for the current thread.
+	/// Pass null to go back to the default world.
+	void setWorld(World* world);
 
 	/// Allocate the memory for entities and components. Can call this manually or let it allocate automatically.
 	void alloc();
@@ -26,6 +68,17 @@ namespace Entity
 	/// Deallocate the memory for entities and components. Only do this when you no longer need the ECS.
 	void dealloc();
 
+	/// Take the world's components and entity tables from an arena, so that `dealloc` releases them in one step.
+	/// See `World::useArena`.
+	void useArena(bool on = true, size_t chunkSize = 1 << 20);
+
+	/// Recycle the memory of deleted components through free lists, one per size class, carved from contiguous slabs.
+	/// Churn of short-lived components then stops calling malloc and free, and components of one class sit
+	/// together in memory. Pools serve every world without an arena and every thread, each thread keeping its
+	/// own free lists, and keep their memory for reuse rather than returning it to the system.
+	/// Components larger than `kMaxPooledComponent` bytes are not pooled.
+	void useComponentPools(bool on = true);
+
 	/// Create an entity and return the `Eid`.
 	Eid create();
 
@@ -35,20 +88,139 @@ namespace Entity
 	/// Return true if the entity has been created.
 	bool exists(Eid eid);
 
+	/// Return the set of all created entities.
+	const Bitset& getBits();
+
+	/// Attach a child entity to a parent entity, or detach it from its parent if `parent` is 0.
+	/// The hierarchy order is kept up to date as it goes: only the child's subtree is moved, and only
+	/// when the child would otherwise come before its new parent.
+	void setParent(Eid child, Eid parent);
+
+	/// Parent/child navigation. Each returns 0 if there is no such entity.
+	Eid getParent(Eid eid);
+	Eid getFirstChild(Eid eid);
+	Eid getNextSibling(Eid eid);
+
+	/// Return every entity which has a parent or children, each after its parent,
+	/// so a propagation pass can sweep the vector once and always visit a parent before its children.
+	/// A freshly built tree comes out breadth-first; reparenting moves subtrees to the end.
+	/// This is an order of Eids only: component pools keep their own order.
+	const std::vector<Eid>& getHierarchy();
+
 	/// Destroy an entity and all its components right now.
+	/// Any children of the entity are destroyed as well.
 	void destroyNow(Eid eid);
 
 	/// Destroy all entities and components right now.
 	void destroyAll();
 
+	/// Create up to `n` entities at once, writing their Eids to `out`, and return how many were created.
+	/// Free Eids are claimed a word at a time rather than one scan per entity.
+	unsigned createMany(unsigned n, Eid* out);
+
+	/// Destroy each of `n` entities right now.
+	void destroyMany(const Eid* eids, unsigned n);
+
+	/// Create up to `n` entities which each get a copy of every component of a prefab,
+	/// writing their Eids to `out` and returning how many were created.
+	unsigned instantiate(const Prefab& prefab, unsigned n, Eid* out);
+
 	/// Component-related methods that require a `Cid`.
 	/// The templated versions of these methods do not require a `Cid`, yet incur an extra function call of overhead.
 	void addComponent(Cid cid, Eid eid, Component* c);
 	void removeComponent(Cid cid, Eid eid);
 	Component* getComponent(Cid cid, Eid eid);
 	const std::vector<Eid>& getAll(Cid cid);
+	Component* const* getComponents(Cid cid);
+	const Bitset& getBits(Cid cid);
 	unsigned count(Cid cid);
 
+	/// Give each of `n` entities a copy of `prototype`, growing the pool once for the whole batch.
+	/// The component class must have been described with `Entity::describe`.
+	void addComponentMany(Cid cid, const Eid* eids, unsigned n, const Component& prototype);
+
+	/// Declare an owning group of components and return its group ID.
+	/// Entities which have every component in the group are kept packed at the front of each member's pool
+	/// in identical order, so `getAll` and `getComponents` of every member can be walked in lockstep
+	/// from index 0 to `groupSize` - 1. A `Cid` can be owned by at most one group.
+	unsigned group(const std::vector<Cid>& cids);
+
+	/// Return the number of entities which currently have every component in the group.
+	unsigned groupSize(unsigned gid);
+
+	/// Register a listener to be notified when components of the given `Cid` are added, removed or changed.
+	void listen(Cid cid, Listener* listener);
+	void unlisten(Cid cid, Listener* listener);
+
+	/// Tell listeners that a component's data has been modified in place.
+	/// Call this after writing to a field which an index depends on.
+	void changed(Cid cid, Eid eid);
+
+	/// Describe a component class so it can be created, copied and serialized without knowing its type.
+	/// Usually called through the templated `Entity::describe<ComponentClass>()`.
+	void describe(Cid cid, const Type& type);
+
+	/// Return the description of a component class, or null if it has not been described.
+	const Type* getType(Cid cid);
+
+	/// Save every entity, parent link and plain-data component into a versioned binary snapshot.
+	/// Components which have not been described as plain data are left out.
+	void save(std::vector<char>& out);
+	bool save(const char* path);
+
+	/// Replace the world with the contents of a snapshot.
+	/// Loading from a path maps the file into memory and reads it in place.
+	bool load(const Snapshot& snapshot);
+	bool load(const void* data, size_t size);
+	bool load(const char* path);
+
+	/// Encode the difference between two snapshots as a compact delta:
+	/// created and destroyed entities, parent changes, added and removed components,
+	/// and the changed byte ranges of plain components which exist in both.
+	/// Without a `to` snapshot the delta leads from `from` to the current world.
+	void diff(const Snapshot& from, const Snapshot& to, std::vector<char>& out);
+	void diff(const Snapshot& from, std::vector<char>& out);
+
+	/// Return a deterministic hash of the live entities and the bytes of every plain component, in Eid order.
+	/// Pass `cids` to hash only those component classes.
+	/// Each 64-entity chunk of each component class is hashed separately and the chunk hashes are combined.
+	/// With `incremental` only chunks where a component was added, removed or reported with
+	/// `Entity::changed` are rehashed, so every write to a hashed component must be reported.
+	/// Plain components should not contain padding, since its contents are undefined.
+	uint64_t worldHash(const std::vector<Cid>& cids = std::vector<Cid>(), bool incremental = false);
+
+	/// Return the profiler which times the systems and structural changes of the world.
+	Profiler& getProfiler();
+
+	/// Measure the memory used by the world, per component class and per subsystem.
+	MemoryStats memoryStats();
+
+	/// Return how many heap allocations the ECS has made on this thread: components allocated with `new`,
+	/// component tables allocated on first use, pool slabs, arena chunks, and pool and hierarchy buffers
+	/// which had to grow. Compile EntityFu.cpp with `EntityFu_CountAllocations` as 1 to count every allocation
+	/// on the thread instead, through a replacement global `operator new`, as the benchmarks do.
+	/// The difference of two readings is the allocations made in between, see `NoAllocations`.
+	uint64_t allocations();
+
+	/// Start or stop recording structural changes of every world: creations, destructions,
+	/// and components added and removed. Each thread records into its own lock-free ring,
+	/// so recording costs a few nanoseconds. When a ring is full, new events are dropped and counted.
+	void trace(bool on);
+
+	/// Move the recorded events of every thread into `out` and return how many were moved.
+	/// Events are in order within each thread. Can be called from any thread, such as a
+	/// background thread which drains periodically. `dropped`, if given, receives the number
+	/// of events lost to full rings since the last drain. The ring of a thread which has exited
+	/// is freed once drained, and its thread number is then given to the next new thread.
+	size_t drainTrace(std::vector<TraceEvent>& out, size_t* dropped = nullptr);
+
+	/// Drain the recorded events and write them as text, one per line, to a file or to stdout if `path` is null.
+	bool dumpTrace(const char* path = nullptr);
+
+	/// Apply a delta made by `diff` to a world which is in the delta's `from` state.
+	/// Listeners are told about each patched component.
+	bool apply(const void* delta, size_t size);
+
 	/// Add the given component to the given entity.
 	/// Note that components must be allocated with new.
 	template<class ComponentClass> inline static void addComponent(Eid eid, ComponentClass* c)
@@ -87,12 +259,37 @@ namespace Entity
 		return Entity::getAll(ComponentClass::cid);
 	}
 
+	/// Get the component pointers for the given component class, in the same order as `getAll`.
+	template<class ComponentClass> inline static Component* const* getComponents()
+	{
+		return Entity::getComponents(ComponentClass::cid);
+	}
+
+	/// Get the set of entities which have the given component class.
+	template<class ComponentClass> inline static const Bitset& getBits()
+	{
+		return Entity::getBits(ComponentClass::cid);
+	}
+
 	/// Count all the entities with the given component class.
 	template<class ComponentClass> inline static unsigned count()
 	{
 		return Entity::count(ComponentClass::cid);
 	}
 
+	/// Tell listeners that a component has been modified in place.
+	template<class ComponentClass> inline static void changed(Eid eid)
+	{
+		Entity::changed(ComponentClass::cid, eid);
+	}
+
+	/// Describe a component class. See `Entity::Type`.
+	/// Pass `plain` = true if all of its members are plain data (no pointers, strings or containers),
+	/// so that its bytes can be copied directly into snapshots.
+	/// The class must be default constructible and copy constructible.
+	/// Descriptions are shared by every world, so describe each class at startup before other threads run.
+	template<class ComponentClass> static void describe(bool plain = false);
+
 	/// A utility method for `Entity::create(...)`.
 	/// The final call to `addComponents`.
 	template <class C> static void addComponents(Eid eid, C* c)
@@ -117,6 +314,131 @@ namespace Entity
 		return eid;
 	}
 
+	/// Give each of `n` entities a copy of `prototype`.
+	/// The component class must have been described with `Entity::describe` before any thread uses it.
+	template <class C> static void addComponentMany(const Eid* eids, unsigned n, const C& prototype)
+	{
+		Entity::addComponentMany(C::cid, eids, n, prototype);
+	}
+
+	/// A utility method for `Entity::createMany(...)`.
+	/// The final call to `addPrototypes`.
+	template <class C> static void addPrototypes(const Eid* eids, unsigned n, const C& c)
+	{
+		Entity::addComponentMany(eids, n, c);
+	}
+
+	/// A utility method for `Entity::createMany(...)`.
+	/// The variadic template version of `addPrototypes`.
+	template <class C, typename ...Args> static void addPrototypes(const Eid* eids, unsigned n, const C& c, const Args&... args)
+	{
+		Entity::addComponentMany(eids, n, c);
+		Entity::addPrototypes(eids, n, args...);
+	}
+
+	/// Create up to `n` entities which each get a copy of every prototype component,
+	/// writing their Eids to `out` and returning how many were created.
+	/// For example `Entity::createMany(10000, eids, Particle(), Velocity(0, 1))`.
+	/// Each prototype's class must have been described with `Entity::describe`.
+	template <typename ...Args> static unsigned createMany(unsigned n, Eid* out, const Args&... prototypes)
+	{
+		n = Entity::createMany(n, out);
+		Entity::addPrototypes(out, n, prototypes...);
+		return n;
+	}
+
+};
+
+///
+/// Bitset
+///
+/// A set of Eids stored one bit per entity with a summary layer on top.
+/// Each summary bit says whether a 64-bit word is non-zero,
+/// so a whole empty 4096-entity region is skipped with a single test.
+///
+class Entity::Bitset
+{
+	public:
+		enum {kWords = (kMaxEntities + 63) / 64, kSummaryWords = (kWords + 63) / 64};
+
+		Bitset() {reset();}
+
+		inline bool test(Eid eid) const {return (words[eid >> 6] >> (eid & 63)) & 1;}
+
+		inline void set(Eid eid)
+		{
+			words[eid >> 6] |= uint64_t(1) << (eid & 63);
+			summary[eid >> 12] |= uint64_t(1) << ((eid >> 6) & 63);
+		}
+
+		inline void clear(Eid eid)
+		{
+			auto& word = words[eid >> 6];
+			word &= ~(uint64_t(1) << (eid & 63));
+			if (word == 0)
+				summary[eid >> 12] &= ~(uint64_t(1) << ((eid >> 6) & 63));
+		}
+
+		/// Set several bits of one word at once.
+		inline void setWord(unsigned w, uint64_t bits)
+		{
+			words[w] |= bits;
+			if (bits != 0)
+				summary[w >> 6] |= uint64_t(1) << (w & 63);
+		}
+
+		/// Clear every bit.
+		void reset();
+
+		/// Count the set bits.
+		unsigned count() const;
+
+		/// Call `f(eid)` for each set bit in ascending order.
+		template<class F> void each(F f) const
+		{
+			for (unsigned s = 0; s < kSummaryWords; ++s)
+			{
+				for (auto bits = summary[s]; bits != 0; bits &= bits - 1)
+				{
+					auto w = (s << 6) + ctz(bits);
+					for (auto word = words[w]; word != 0; word &= word - 1)
+						f(Eid((w << 6) + ctz(word)));
+				}
+			}
+		}
+
+		/// Store the intersection of `a` and `b` in `out`, one word at a time.
+		/// Regions which are empty in either summary are skipped.
+		static void intersect(Bitset& out, const Bitset& a, const Bitset& b);
+
+		/// Call `f(eid)` for each Eid which is set in both `a` and `b`, in ascending order.
+		template<class F> static void each(const Bitset& a, const Bitset& b, F f)
+		{
+			for (unsigned s = 0; s < kSummaryWords; ++s)
+			{
+				for (auto bits = a.summary[s] & b.summary[s]; bits != 0; bits &= bits - 1)
+				{
+					auto w = (s << 6) + ctz(bits);
+					for (auto word = a.words[w] & b.words[w]; word != 0; word &= word - 1)
+						f(Eid((w << 6) + ctz(word)));
+				}
+			}
+		}
+
+		/// Count trailing zeros of a non-zero word.
+		static inline unsigned ctz(uint64_t x)
+		{
+#ifdef _MSC_VER
+			unsigned long i;
+			_BitScanForward64(&i, x);
+			return (unsigned)i;
+#else
+			return (unsigned)__builtin_ctzll(x);
+#endif
+		}
+
+		uint64_t words[kWords];
+		uint64_t summary[kSummaryWords];
 };
 
 ///
@@ -134,6 +456,1255 @@ struct Entity::Component
 	virtual bool full() const;
 	static Cid numCids;
 	// static Cid cid;
+
+	/// Components are zero-filled when allocated, so padding bytes hash and diff deterministically.
+	/// They come from a world's arena only while the world allocates them itself, see `World::useArena`.
+	/// Component classes must not replace these operators, since deletion reads a header which `new` writes.
+	static void* operator new(size_t size);
+	static void operator delete(void* p);
+};
+
+///
+/// Type
+///
+/// Runtime description of a component class.
+/// The data of a plain component is the `dataSize` bytes which follow the `Component` base.
+///
+struct Entity::Type
+{
+	unsigned size;
+	unsigned dataSize;
+	bool plain;
+	Component* (*create)();
+	Component* (*clone)(const Component* c);
+
+	/// Return a pointer to the data of a plain component.
+	static inline char* data(Component* c) {return reinterpret_cast<char*>(c) + sizeof(Component);}
+	static inline const char* data(const Component* c) {return reinterpret_cast<const char*>(c) + sizeof(Component);}
+};
+
+template<class ComponentClass> void Entity::describe(bool plain)
+{
+	Type type;
+	type.size = sizeof(ComponentClass);
+	type.dataSize = sizeof(ComponentClass) - sizeof(Component);
+	type.plain = plain;
+	type.create = []() -> Component* {return new ComponentClass();};
+	type.clone = [](const Component* c) -> Component* {return new ComponentClass(*static_cast<const ComponentClass*>(c));};
+	Entity::describe(ComponentClass::cid, type);
+}
+
+///
+/// Snapshot
+///
+/// A read-only view of a snapshot made by `Entity::save`.
+/// Every section of the format is 8-byte aligned and located by an offset from the start of the buffer,
+/// so a memory-mapped file can be read in place without copying or pointer fixups.
+///
+class Entity::Snapshot
+{
+	public:
+		enum {kVersion = 1};
+
+		/// A saved component pool. `eids` are in the same order as `getAll` was when saved,
+		/// and `data` holds `dataSize` bytes per Eid.
+		struct Pool
+		{
+			Cid cid;
+			unsigned count;
+			unsigned dataSize;
+			const Eid* eids;
+			const char* data;
+		};
+
+		/// Point the view at a snapshot buffer. Returns false if the buffer is not a valid snapshot,
+		/// including one whose parent links are not trees of live entities.
+		bool open(const void* data, size_t size);
+
+		/// Return true if the entity existed when the snapshot was saved.
+		inline bool exists(Eid eid) const {return eid < maxEntities && ((live[eid >> 6] >> (eid & 63)) & 1);}
+
+		unsigned maxEntities;
+		const uint64_t* live;
+		const Eid* parents;
+		std::vector<Pool> pools;
+};
+
+///
+/// History
+///
+/// A ring of recent world states for rollback, stored as undo deltas.
+/// Call `save(tick)` after each simulated tick and `restore(tick)` to rewind to any of the last `capacity` ticks.
+/// The world tells its history which entities and components it touches, so saving and restoring cost
+/// in proportion to what changed rather than to the size of the world. The first save copies everything.
+/// As with indexes, call `Entity::changed` after modifying a component in place, or the history will not see it.
+/// Like snapshots, only components described as plain data are rolled back.
+/// After a restore the order of `getAll` may differ, so iterate with `getBits` where determinism matters.
+/// A world has at most one history at a time.
+///
+class Entity::History
+{
+	public:
+		History(unsigned capacity = 8, World& world = Entity::getWorld());
+		~History();
+
+		/// Record the current world as the state at `tick`.
+		void save(unsigned tick);
+
+		/// Rewind the world to a recorded tick and forget every later tick.
+		bool restore(unsigned tick);
+
+		/// Return true if the world can be restored to `tick`.
+		bool has(unsigned tick) const;
+
+		/// Forget every recorded tick.
+		void clear();
+
+	private:
+		friend class World;
+
+		History(const History&) = delete;
+		History& operator=(const History&) = delete;
+
+		struct Frame
+		{
+			unsigned tick;
+			std::vector<char> undo;
+		};
+
+		/// The plain components of one class as of the last save, each Eid's slot + 1 or 0,
+		/// and which Eids have been touched since.
+		struct Pool
+		{
+			unsigned dataSize;
+			std::vector<unsigned> slots;
+			std::vector<char> data;
+			std::vector<unsigned> free;
+			std::vector<uint64_t> touched;
+		};
+
+		/// Called by the world as it creates, destroys and reparents entities and adds, removes and changes components.
+		void touch(Eid eid);
+		void touch(Cid cid, Eid eid);
+
+		/// Write a delta which takes the world back to the last save, and bring the copy up to date with the world.
+		void undo(std::vector<char>& out);
+		void sync();
+		void syncAll();
+		inline bool wasLive(Eid eid) const {return (live[eid >> 6] >> (eid & 63)) & 1;}
+
+		World* world;
+		std::vector<Frame> frames;
+		unsigned head, count, last;
+		bool synced;
+
+		/// The world as of the last save.
+		std::vector<uint64_t> live;
+		std::vector<Eid> parents;
+		std::vector<Pool> pools;
+
+		/// Entities and components touched since the last save.
+		std::vector<uint64_t> touchedEntities;
+		std::vector<Eid> entityList;
+		std::vector<std::pair<Cid, Eid>> componentList;
+		std::vector<char> delta;
+};
+
+///
+/// Listener
+///
+/// Receives notifications for one component class. See `Entity::listen`.
+/// `removed` is called before the component is deleted.
+/// `cleared` is called instead of `removed` when a world with an arena drops every component at once.
+///
+struct Entity::Listener
+{
+	virtual ~Listener();
+	virtual void added(Eid eid, Component* c) {}
+	virtual void removed(Eid eid, Component* c) {}
+	virtual void changed(Eid eid, Component* c) {}
+	virtual void cleared() {}
+};
+
+///
+/// Histogram
+///
+/// A high-dynamic-range histogram of durations in nanoseconds. Buckets double in width every power of two,
+/// so percentiles are within 1/64 of the true value anywhere from 1 ns to about 4.9 hours (longer values
+/// count as that), while the histogram stays a fixed 20 KB however many values it records.
+///
+class Entity::Histogram
+{
+	public:
+		enum {kSubBits = 7, kMaxBits = 44, kBuckets = (kMaxBits - kSubBits + 2) << (kSubBits - 1)};
+
+		Histogram();
+
+		void record(uint64_t nanoseconds);
+		inline void recordSeconds(double seconds) {record(seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);}
+
+		/// Return the value which `percent` of the recorded values are at or below, or 0 if there are none.
+		uint64_t percentile(double percent) const;
+		inline uint64_t p50() const {return percentile(50);}
+		inline uint64_t p90() const {return percentile(90);}
+		inline uint64_t p99() const {return percentile(99);}
+		inline uint64_t p999() const {return percentile(99.9);}
+		inline uint64_t minimum() const {return numValues > 0 ? lowest : 0;}
+		inline uint64_t maximum() const {return highest;}
+		inline uint64_t count() const {return numValues;}
+		double mean() const;
+
+		/// Forget every value, for example once a minute to keep percentiles current.
+		void reset();
+
+		/// Add the values of another histogram, for example the same system in another world.
+		void merge(const Histogram& other);
+
+		/// Return the bytes held by the buckets.
+		inline size_t memoryUsed() const {return counts.capacity() * sizeof(uint64_t);}
+
+	private:
+		static unsigned bucket(uint64_t value);
+		static uint64_t highestEquivalent(unsigned bucket);
+
+		/// Allocated by the first value.
+		std::vector<uint64_t> counts;
+		uint64_t numValues, lowest, highest;
+		double sum;
+};
+
+///
+/// NoAllocations
+///
+/// Marks a region which must not allocate, such as a steady-state tick.
+/// When the region ends after allocations were counted within it, see `Entity::allocations`,
+/// the count is printed to stderr and the program aborts, in release builds as well as debug ones.
+///
+class Entity::NoAllocations
+{
+	public:
+		inline NoAllocations(const char* name = "region") : name(name), start(Entity::allocations()) {}
+		~NoAllocations();
+
+		/// Return the allocations made so far within the region.
+		inline uint64_t count() const {return Entity::allocations() - start;}
+
+	private:
+		NoAllocations(const NoAllocations&) = delete;
+		NoAllocations& operator=(const NoAllocations&) = delete;
+
+		const char* name;
+		uint64_t start;
+};
+
+///
+/// Arena
+///
+/// A monotonic allocator which hands out memory from large chunks and frees it all at once.
+///
+class Entity::Arena
+{
+	public:
+		Arena(size_t chunkSize = 1 << 20);
+		~Arena();
+
+		/// Return `size` bytes aligned to `align`, which must be a power of two.
+		void* allocate(size_t size, size_t align = 16);
+
+		/// Free everything allocated at once. The first chunk is kept for reuse.
+		void reset();
+
+		inline size_t used() const {return usedBytes;}
+		size_t reserved() const;
+
+	private:
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		struct Chunk
+		{
+			char* data;
+			size_t size;
+		};
+
+		/// Memory is handed out from the last chunk, starting at `offset`.
+		std::vector<Chunk> chunks;
+		size_t chunkSize;
+		size_t offset;
+		size_t usedBytes;
+};
+
+///
+/// Profiler
+///
+/// Times named scopes such as systems and structural changes, keeping per-scope statistics and a trace.
+/// Each world has one, which the registered systems of `System::tick` and `System::animate` are timed by.
+/// While disabled, which is the default, a scope costs a single branch.
+/// Scopes nest, and must be opened and closed on the world's thread.
+///
+class Entity::Profiler
+{
+	public:
+		enum {kWindow = 128, kMaxEvents = 1 << 20};
+
+		/// Hardware counters, see `enableCounters`.
+		enum Counter {Cycles, Instructions, L1Misses, LlcMisses, BranchMisses, kCounters};
+
+		/// Statistics of one named scope. Times are in seconds.
+		/// `p50` and `p99` are over the last `kWindow` calls and are updated by `getStats`.
+		/// `histogram` holds every call's duration since the last `resetHistograms`.
+		/// `counters` are totals over every call while hardware counters were enabled.
+		/// `cids` are the component pools the scope was declared to touch.
+		/// `allocations` counts the heap allocations over every call, see `Entity::allocations`.
+		struct Stats
+		{
+			const char* name;
+			unsigned calls;
+			unsigned entities;
+			double last, total, p50, p99;
+			std::vector<double> recent;
+			uint64_t counters[kCounters];
+			std::vector<Cid> cids;
+			Histogram histogram;
+			uint64_t allocations, lastAllocations;
+		};
+
+		/// Times one call of a named scope while the profiler is enabled.
+		/// The name must outlive the profiler, as string literals do.
+		class Scope
+		{
+			public:
+				inline Scope(Profiler& profiler, const char* name, const std::vector<Cid>* cids = nullptr) :
+					profiler(profiler.enabled ? &profiler : nullptr)
+				{
+					if (this->profiler != nullptr)
+						this->profiler->begin(name, cids);
+				}
+
+				inline ~Scope()
+				{
+					if (profiler != nullptr)
+						profiler->end();
+				}
+
+			private:
+				Scope(const Scope&) = delete;
+				Scope& operator=(const Scope&) = delete;
+
+				Profiler* profiler;
+		};
+
+		Profiler();
+		~Profiler();
+
+		/// Start or stop profiling. Scopes which are already open are still closed.
+		void enable(bool on = true);
+		inline bool isEnabled() const {return enabled;}
+
+		/// Count entities processed by the innermost open scope.
+		inline void processed(unsigned n)
+		{
+			if (!open.empty())
+				open.back().entities += n;
+		}
+
+		/// Also read hardware counters around every scope, using `perf_event_open` on Linux.
+		/// Counters are per thread, so scopes must run on the thread which enabled them.
+		/// Returns false if no counter is available, as on other platforms or when the kernel or
+		/// container forbids them. Counters which are unavailable on their own read as zero.
+		bool enableCounters(bool on = true);
+		inline bool hasCounter(Counter counter) const {return counterSlots[counter] >= 0;}
+
+		/// Return the statistics of every scope timed so far.
+		const std::vector<Stats>& getStats();
+
+		/// Return the duration histogram of a named scope, such as "System::tick", or null if it has not run.
+		const Histogram* getHistogram(const char* name) const;
+
+		/// Clear every scope's histogram, leaving the other statistics. Call this periodically
+		/// so that percentiles describe the recent past rather than the whole run.
+		void resetHistograms();
+
+		/// Sum the hardware counters of every scope declared to touch a component pool.
+		/// A scope which touches several pools has its counters split evenly between them.
+		void getPoolCounters(Cid cid, uint64_t out[kCounters]) const;
+
+		/// Write the recorded scopes as Chrome trace-event JSON, for `chrome://tracing` or Perfetto.
+		/// At most `kMaxEvents` are recorded between resets.
+		bool writeTrace(const char* path) const;
+
+		/// Forget all statistics and recorded scopes.
+		void reset();
+
+		/// Return the bytes held by statistics and recorded scopes.
+		size_t memoryUsed() const;
+
+		void begin(const char* name, const std::vector<Cid>* cids = nullptr);
+		void end();
+
+	private:
+		Profiler(const Profiler&) = delete;
+		Profiler& operator=(const Profiler&) = delete;
+
+		struct Open
+		{
+			unsigned stat;
+			double start;
+			unsigned entities;
+			uint64_t counters[kCounters];
+			uint64_t allocations;
+		};
+
+		void readCounters(uint64_t out[kCounters]);
+
+		struct Event
+		{
+			unsigned stat;
+			unsigned depth;
+			double start, duration;
+			unsigned entities;
+		};
+
+		bool enabled;
+		double epoch;
+		std::vector<Stats> stats;
+		std::vector<Open> open;
+		std::vector<Event> events;
+		std::vector<double> sorted;
+
+		/// The perf event group, and where each counter is in a read of the group, or -1.
+		bool counting;
+		int counterLeader;
+		int counterFds[kCounters];
+		int counterSlots[kCounters];
+		unsigned numCounterSlots;
+};
+
+///
+/// MemoryStats
+///
+/// Bytes held by a world, as reported by `Entity::memoryStats`.
+/// Capacity counts everything allocated, used counts only what holds live entries,
+/// and fragmentation is the fraction of capacity which is not used.
+///
+struct Entity::MemoryStats
+{
+	struct Pool
+	{
+		Cid cid;
+		unsigned count;
+
+		/// The Eid-indexed pointer and index tables, which are not allocated until the first component is added.
+		size_t sparseBytes;
+
+		/// The packed `getAll` Eids and component pointers, by capacity and by size.
+		size_t denseBytes, denseUsedBytes;
+
+		/// The components themselves, each with the 16-byte header written by `Component::operator new`.
+		/// Only known for classes described with `Entity::describe`.
+		size_t payloadBytes;
+		bool described;
+
+		/// The membership bitset and incremental hash caches.
+		size_t bitsBytes;
+
+		size_t capacityBytes, usedBytes;
+		double fragmentation;
+	};
+
+	std::vector<Pool> pools;
+
+	/// Subsystem totals: live and claimed entity bits, parent/child links and the hierarchy order,
+	/// all pools, owning groups and listeners, and the profiler's statistics and trace.
+	size_t entityBytes, linkBytes, poolBytes, groupBytes, profilerBytes;
+
+	size_t totalBytes;
+
+	/// Bytes reserved and used by the world's arena, if any. The arena holds memory already counted above.
+	size_t arenaBytes, arenaUsedBytes;
+
+	/// Bytes of slabs reserved by the component pools, which every world shares, see `Entity::useComponentPools`.
+	size_t componentPoolBytes;
+};
+
+///
+/// TraceEvent
+///
+/// A structural change recorded by `Entity::trace`.
+/// `time` is in nanoseconds on a monotonic clock, and `thread` numbers the recording threads from 0.
+///
+struct Entity::TraceEvent
+{
+	enum Op {Create, Destroy, Add, Remove};
+
+	uint64_t time;
+	Eid eid;
+	Cid cid;
+	uint16_t op;
+	uint16_t thread;
+};
+
+///
+/// World
+///
+/// Owns every entity and component along with the groups, listeners and links built on them.
+/// The functions in the `Entity` namespace forward to the world returned by `Entity::getWorld()`.
+/// Worlds share no mutable state, so separate worlds can run on separate threads,
+/// each calling `Entity::setWorld` once so that systems and templated helpers use it.
+/// The methods here behave like the functions of the same name in the `Entity` namespace.
+///
+class Entity::World
+{
+	public:
+		World();
+		~World();
+
+		void alloc();
+		void dealloc();
+
+		/// Take components and entity tables from an arena owned by the world, allocated `chunkSize` bytes at a time.
+		/// `dealloc` then releases everything in one step rather than destroying entities one by one, so
+		/// listeners are not told and component destructors do not run: use it for components which own nothing.
+		/// Memory of components removed earlier is only reclaimed by `dealloc`. Call this before the world allocates.
+		/// Components go to the arena only when the world allocates them itself, as `load`, `apply`,
+		/// `addComponentMany` and `instantiate` do. Components made with `new` come from the heap or the component
+		/// pools even while this is the current world, so a `Spawner` on another thread never touches the arena,
+		/// which is not thread-safe. They still work and are deleted by `dealloc`.
+		void useArena(bool on = true, size_t chunkSize = 1 << 20);
+		inline Arena* getArena() const {return arena;}
+
+		Eid create();
+		unsigned count();
+		bool exists(Eid eid);
+		const Bitset& getBits();
+		void setParent(Eid child, Eid parent);
+		Eid getParent(Eid eid);
+		Eid getFirstChild(Eid eid);
+		Eid getNextSibling(Eid eid);
+		const std::vector<Eid>& getHierarchy();
+		void destroyNow(Eid eid);
+		void destroyAll();
+		unsigned createMany(unsigned n, Eid* out);
+		void destroyMany(const Eid* eids, unsigned n);
+		unsigned instantiate(const Prefab& prefab, unsigned n, Eid* out);
+
+		void addComponent(Cid cid, Eid eid, Component* c);
+		void removeComponent(Cid cid, Eid eid);
+		Component* getComponent(Cid cid, Eid eid);
+		const std::vector<Eid>& getAll(Cid cid);
+		Component* const* getComponents(Cid cid);
+		const Bitset& getBits(Cid cid);
+		unsigned count(Cid cid);
+		void addComponentMany(Cid cid, const Eid* eids, unsigned n, const Component& prototype);
+
+		unsigned group(const std::vector<Cid>& cids);
+		unsigned groupSize(unsigned gid);
+		void listen(Cid cid, Listener* listener);
+		void unlisten(Cid cid, Listener* listener);
+		void changed(Cid cid, Eid eid);
+
+		void save(std::vector<char>& out);
+		bool save(const char* path);
+		bool load(const Snapshot& snapshot);
+		bool load(const void* data, size_t size);
+		bool load(const char* path);
+		void diff(const Snapshot& from, std::vector<char>& out);
+		bool apply(const void* delta, size_t size);
+		uint64_t worldHash(const std::vector<Cid>& cids = std::vector<Cid>(), bool incremental = false);
+		Profiler& getProfiler();
+		MemoryStats memoryStats();
+
+		/// Measure into `stats`, reusing its pool vector so that repeated measurements do not allocate.
+		void memoryStats(MemoryStats& stats);
+
+		/// Return the telemetry publishing this world, or null.
+		inline Telemetry* getTelemetry() const {return telemetry;}
+
+	private:
+		friend class Spawner;
+		friend class Recorder;
+		friend class Telemetry;
+		friend class Prefab;
+		friend class History;
+
+		World(const World&) = delete;
+		World& operator=(const World&) = delete;
+
+		/// An owning group.
+		struct GroupData
+		{
+			std::vector<Cid> cids;
+			unsigned size;
+		};
+
+		/// Parent/child links of one entity.
+		struct Link
+		{
+			Eid parent, firstChild, prevSibling, nextSibling;
+
+			/// One past the entity's position in `hierarchy`, or 0 if it is not there.
+			unsigned order;
+		};
+
+		void swapSlots(Cid cid, unsigned a, unsigned b);
+		void join(GroupData& group, Eid eid);
+		void leave(GroupData& group, Eid eid);
+		uint64_t hashChunk(Cid cid, unsigned w, unsigned dataSize);
+		unsigned reserve(Eid* out, unsigned max);
+		bool isWithin(Eid eid, Eid ancestor) const;
+		void orderAppend(Eid eid);
+		void orderRemove(Eid eid);
+		void orderSubtree(Eid eid);
+		void release(Eid eid);
+		void revive(Eid eid);
+
+		/// `getComponent` without recording, for the ECS's own lookups.
+		inline Component* peek(Cid cid, Eid eid) const
+		{
+			return eid < kMaxEntities && cid < Component::numCids ? components[cid][eid] : nullptr;
+		}
+
+		inline void dirty(Cid cid, Eid eid)
+		{
+			dirtyChunks[cid][eid >> 12] |= uint64_t(1) << ((eid >> 6) & 63);
+			if (history != nullptr)
+				history->touch(cid, eid);
+		}
+
+		/// Tell the history, if any, that an entity was created, destroyed or reparented.
+		inline void touch(Eid eid)
+		{
+			if (history != nullptr)
+				history->touch(eid);
+		}
+
+		int verbosity;
+
+		/// Entities and component pools.
+		Bitset* entities;
+		Bitset* componentBits;
+		Component*** components;
+		std::vector<Eid>* componentEids;
+		std::vector<Component*>* componentPointers;
+		unsigned** componentIndices;
+
+		/// Eids which are created or reserved by a `Spawner`, one bit each, claimed with atomic operations.
+		/// The lowest Eid which might be free, and where spawners look for free Eids next.
+		std::atomic<uint64_t>* claimed;
+		Eid firstFree;
+		std::atomic<unsigned> reserveCursor;
+
+		/// Owning groups, and which group owns each component.
+		std::vector<GroupData> groups;
+		std::vector<int> componentGroups;
+
+		/// Listeners for each component.
+		std::vector<std::vector<Listener*>> listeners;
+
+		/// Parent/child links, and every linked entity after its parent.
+		/// Removed entities leave a 0 in `hierarchy` until `getHierarchy` closes the gaps.
+		Link* links;
+		std::vector<Eid> hierarchy;
+		unsigned hierarchyGaps;
+
+		/// Cached hash of each 64-entity chunk of each component, and which chunks need rehashing.
+		std::vector<std::vector<uint64_t>> chunkHashes;
+		std::vector<std::vector<uint64_t>> dirtyChunks;
+		std::vector<char> hashBuffer;
+
+		Profiler profiler;
+		Recorder* recorder;
+		Telemetry* telemetry;
+		History* history;
+
+		/// The arena, if any, and how many components in the pools were not allocated from it.
+		Arena* arena;
+		unsigned foreignComponents;
+};
+
+///
+/// Spawner
+///
+/// Creates and destroys entities from a worker thread.
+/// Eids are reserved in blocks of up to 64 with lock-free atomic claims on the world, so spawners on many threads
+/// (and `create` on the world's own thread) never hand out the same Eid.
+/// Components and destructions are staged and only reach the world in `commit`,
+/// which must be called on the world's thread at a sync point while the worker is idle.
+/// Construct and destroy the spawner on the world's thread, and use it from one worker thread at a time in between.
+/// Components staged by a worker come from the heap or the component pools, never from the world's arena.
+///
+class Entity::Spawner
+{
+	public:
+		Spawner(World& world = Entity::getWorld());
+		~Spawner();
+
+		/// Reserve an Eid for a new entity. It exists in the world after `commit`.
+		/// Returns 0 if the world is full.
+		Eid create();
+
+		/// Stage a component for an entity created by this spawner or an existing entity.
+		void addComponent(Cid cid, Eid eid, Component* c);
+
+		/// Stage the destruction of an entity.
+		void destroy(Eid eid);
+
+		/// Apply everything staged to the world, in order: creations, components, then destructions.
+		void commit();
+
+		template<class ComponentClass> void addComponent(Eid eid, ComponentClass* c)
+		{
+			addComponent(ComponentClass::cid, eid, c);
+		}
+
+		template <typename ...Args> Eid create(Args... args)
+		{
+			auto eid = create();
+			addComponents(eid, args...);
+			return eid;
+		}
+
+	private:
+		Spawner(const Spawner&) = delete;
+		Spawner& operator=(const Spawner&) = delete;
+
+		template <class C> void addComponents(Eid eid, C* c)
+		{
+			addComponent(C::cid, eid, c);
+		}
+
+		template <class C, typename ...Args> void addComponents(Eid eid, C* c, Args... args)
+		{
+			addComponent(C::cid, eid, c);
+			addComponents(eid, args...);
+		}
+
+		struct Staged
+		{
+			Cid cid;
+			Eid eid;
+			Component* c;
+		};
+
+		World* world;
+		std::vector<Eid> reserved;
+		std::vector<Eid> created;
+		std::vector<Staged> components;
+		std::vector<Eid> destroyed;
+};
+
+///
+/// Prefab
+///
+/// A reusable set of prototype components, such as a "goblin" or a "bullet",
+/// which `Entity::instantiate` copies onto many new entities at once.
+/// Each component class must have been described with `Entity::describe` so it can be cloned.
+/// Components described as plain are copied with `memcpy`; others use their copy constructor.
+///
+class Entity::Prefab
+{
+	public:
+		Prefab();
+
+		/// Copy every component of a template entity.
+		Prefab(Eid eid, World& world = Entity::getWorld());
+
+		~Prefab();
+
+		/// Add a prototype component, replacing any of the same `Cid`. The prefab takes ownership.
+		/// A component whose class has not been described is deleted instead.
+		void add(Cid cid, Component* c);
+
+		template<class ComponentClass> void add(ComponentClass* c)
+		{
+			add(ComponentClass::cid, c);
+		}
+
+	private:
+		friend class World;
+
+		Prefab(const Prefab&) = delete;
+		Prefab& operator=(const Prefab&) = delete;
+
+		struct Part
+		{
+			Cid cid;
+			Component* c;
+		};
+
+		std::vector<Part> parts;
+};
+
+///
+/// Recorder
+///
+/// Records the calls made on a world to a compact binary trace file, so that a real workload
+/// can be replayed by `tools/replay` to compare changes to storage on exactly the same calls.
+/// Recorded calls are `create`, `destroyNow`, `addComponent` with the component's described size,
+/// `removeComponent`, `getComponent`, `getAll` and `getComponents`. Batch functions, `load` and `apply` record
+/// the components they add and remove. Lookups and removals the ECS makes for itself, such as in `destroyNow`,
+/// `apply` and `Prefab`, are not recorded, while groups, indices and spatial grids record the world calls they make.
+/// Recording starts when the recorder is constructed and stops when it is destroyed.
+///
+class Entity::Recorder
+{
+	public:
+		enum {kVersion = 1};
+		enum Op {Create, Destroy, Add, Remove, Get, GetAll, GetComponents};
+
+		Recorder(const char* path, World& world = Entity::getWorld());
+		~Recorder();
+
+		/// Return true if the trace file could be opened.
+		inline bool isOpen() const {return file != nullptr;}
+
+		/// Write buffered calls to the file.
+		void flush();
+
+		/// Record one call.
+		void record(unsigned op, Cid cid, Eid eid, unsigned size = 0);
+
+	private:
+		friend class World;
+
+		Recorder(const Recorder&) = delete;
+		Recorder& operator=(const Recorder&) = delete;
+
+		World* world;
+		FILE* file;
+		std::vector<char> buffer;
+};
+
+///
+/// TelemetryPage
+///
+/// Live statistics of a world, published in POSIX shared memory by `Entity::Telemetry`.
+/// The page is protected by a sequence lock: the sequence is odd while the page is being written,
+/// so a reader copies the page and retries until the sequence was even and unchanged, as `read` does.
+/// Times are in seconds. Systems are the scopes of the world's profiler, if it is enabled.
+///
+struct Entity::TelemetryPage
+{
+	enum {kMagic = 0x4d4c4554, kVersion = 1, kMaxCids = 256, kMaxSystems = 64, kNameSize = 32, kReadTimeout = 100};
+
+	struct System
+	{
+		char name[kNameSize];
+		uint32_t calls;
+		uint32_t entities;
+		double last, p50, p99;
+	};
+
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> sequence;
+	uint32_t numCids;
+	uint64_t tick;
+	uint64_t memoryBytes;
+	uint32_t entities;
+	uint32_t numSystems;
+	uint32_t populations[kMaxCids];
+	System systems[kMaxSystems];
+
+	/// Copy a consistent snapshot of a shared page into `out`, with its counts clamped to the arrays.
+	/// Returns false if the page is not valid, or if no consistent copy can be made within
+	/// `kReadTimeout` milliseconds, as when the publisher died while writing it.
+	static bool read(const TelemetryPage* page, TelemetryPage& out);
+};
+
+///
+/// Telemetry
+///
+/// Publishes a world's statistics to a shared memory segment which other processes can map and read
+/// without pausing the simulation. `System::tick` publishes once per tick while the telemetry exists.
+/// The segment is removed when the telemetry is destroyed. Only available on POSIX systems.
+///
+class Entity::Telemetry
+{
+	public:
+		/// Create the shared memory segment. Names start with a slash, as in "/entityfu".
+		Telemetry(const char* name = "/entityfu", World& world = Entity::getWorld());
+		~Telemetry();
+
+		/// Return true if the shared memory segment could be created.
+		inline bool isOpen() const {return page != nullptr;}
+
+		/// Write the current statistics of the world to the page. Called by `System::tick`.
+		/// Memory use scans every pool, so it is only measured every `kMemoryInterval` publishes.
+		void publish();
+
+		enum {kMemoryInterval = 60};
+
+		/// Map a published page read-only, for reader tools. Returns null if there is no such page.
+		static const TelemetryPage* open(const char* name);
+		static void close(const TelemetryPage* page);
+
+	private:
+		Telemetry(const Telemetry&) = delete;
+		Telemetry& operator=(const Telemetry&) = delete;
+
+		friend class World;
+
+		World* world;
+		TelemetryPage* page;
+		uint64_t tick;
+		MemoryStats memory;
+		char name[64];
+};
+
+///
+/// Group
+///
+namespace Entity
+{
+	/// A typed owning group.
+	/// Example: `static Entity::Group<Transform, Velocity> moving;`
+	/// then `for (unsigned i = 0; i < moving.size(); ++i) moving.get<Transform>(i).x += moving.get<Velocity>(i).x;`
+	template <class ...ComponentClasses> struct Group
+	{
+		World* world;
+		unsigned gid;
+		Cid first;
+
+		Group(World& world = Entity::getWorld()) : world(&world)
+		{
+			std::vector<Cid> cids = {ComponentClasses::cid...};
+			gid = world.group(cids);
+			first = cids.front();
+		}
+
+		unsigned size() const {return world->groupSize(gid);}
+
+		Eid eid(unsigned i) const {return world->getAll(first)[i];}
+
+		template<class ComponentClass> ComponentClass& get(unsigned i) const
+		{
+			return *static_cast<ComponentClass*>(world->getComponents(ComponentClass::cid)[i]);
+		}
+	};
+};
+
+///
+/// Index
+///
+/// A secondary index which maps the value of a component field to Eids.
+/// The index listens to the component class, so it stays in sync as components are added and removed.
+/// After modifying the indexed field of an existing component, call `Entity::changed<ComponentClass>(eid)`.
+/// Use `HashIndex` for constant time lookups or `OrderedIndex` for range queries.
+/// Example: `Entity::HashIndex<NetworkIdComponent, unsigned> byNetId(&NetworkIdComponent::id);`
+/// An index belongs to the current world unless another world is passed to its constructor.
+///
+namespace Entity
+{
+	template<class ComponentClass, class Key, class Map> class Index : public Listener
+	{
+		public:
+			Index(Key ComponentClass::*field, World& world) : world(&world), field(field)
+			{
+				for (auto eid : world.getAll(ComponentClass::cid))
+					added(eid, world.getComponent(ComponentClass::cid, eid));
+				world.listen(ComponentClass::cid, this);
+			}
+
+			virtual ~Index()
+			{
+				world->unlisten(ComponentClass::cid, this);
+			}
+
+			/// Return an Eid whose field equals the key, or 0 if there is none.
+			Eid find(const Key& key) const
+			{
+				auto it = map.find(key);
+				return it != map.end() ? it->second : 0;
+			}
+
+			/// Append every Eid whose field equals the key.
+			void findAll(const Key& key, std::vector<Eid>& out) const
+			{
+				auto range = map.equal_range(key);
+				for (auto it = range.first; it != range.second; ++it)
+					out.push_back(it->second);
+			}
+
+			/// Return the number of entities whose field equals the key.
+			unsigned count(const Key& key) const {return (unsigned)map.count(key);}
+
+			/// Return the number of indexed entities.
+			unsigned size() const {return (unsigned)keys.size();}
+
+			virtual void added(Eid eid, Component* c)
+			{
+				auto& key = static_cast<ComponentClass*>(c)->*field;
+				keys[eid] = key;
+				map.insert(std::make_pair(key, eid));
+			}
+
+			virtual void removed(Eid eid, Component* c)
+			{
+				auto it = keys.find(eid);
+				if (it == keys.end())
+					return;
+				erase(it->second, eid);
+				keys.erase(it);
+			}
+
+			virtual void changed(Eid eid, Component* c)
+			{
+				auto& key = static_cast<ComponentClass*>(c)->*field;
+				auto it = keys.find(eid);
+				if (it != keys.end())
+				{
+					if (it->second == key)
+						return;
+					erase(it->second, eid);
+					it->second = key;
+				}
+				else
+					keys[eid] = key;
+				map.insert(std::make_pair(key, eid));
+			}
+
+			virtual void cleared()
+			{
+				map.clear();
+				keys.clear();
+			}
+
+		protected:
+			void erase(const Key& key, Eid eid)
+			{
+				auto range = map.equal_range(key);
+				for (auto it = range.first; it != range.second; ++it)
+				{
+					if (it->second == eid)
+					{
+						map.erase(it);
+						return;
+					}
+				}
+			}
+
+			World* world;
+			Key ComponentClass::*field;
+			Map map;
+			std::unordered_map<Eid, Key> keys;
+	};
+
+	template<class ComponentClass, class Key, class Hash = std::hash<Key>>
+	class HashIndex : public Index<ComponentClass, Key, std::unordered_multimap<Key, Eid, Hash>>
+	{
+		public:
+			HashIndex(Key ComponentClass::*field, World& world = Entity::getWorld()) :
+				Index<ComponentClass, Key, std::unordered_multimap<Key, Eid, Hash>>(field, world) {}
+	};
+
+	template<class ComponentClass, class Key, class Compare = std::less<Key>>
+	class OrderedIndex : public Index<ComponentClass, Key, std::multimap<Key, Eid, Compare>>
+	{
+		public:
+			OrderedIndex(Key ComponentClass::*field, World& world = Entity::getWorld()) :
+				Index<ComponentClass, Key, std::multimap<Key, Eid, Compare>>(field, world) {}
+
+			/// Append every Eid whose field is within [lo, hi], in key order.
+			void range(const Key& lo, const Key& hi, std::vector<Eid>& out) const
+			{
+				auto end = this->map.upper_bound(hi);
+				for (auto it = this->map.lower_bound(lo); it != end; ++it)
+					out.push_back(it->second);
+			}
+	};
+};
+
+///
+/// SpatialGrid
+///
+/// A uniform grid of Eids bound to a position component, for radius and rectangle queries.
+/// The grid listens to the position class, so entities are added and removed automatically.
+/// After moving an entity either call `Entity::changed<PositionClass>(eid)` or `move(eid)`,
+/// or call `update()` once per tick to pick up every moved entity.
+/// Pick a cell size around the most common query diameter.
+/// Example: `Entity::SpatialGrid<PositionComponent> grid(16.f, &PositionComponent::x, &PositionComponent::y);`
+///
+namespace Entity
+{
+	template<class PositionClass, class Scalar = float> class SpatialGrid : public Listener
+	{
+		public:
+			SpatialGrid(Scalar cellSize, Scalar PositionClass::*x, Scalar PositionClass::*y, World& world = Entity::getWorld()) :
+				world(&world),
+				cellSize(cellSize),
+				invCellSize(Scalar(1) / cellSize),
+				x(x),
+				y(y),
+				count(0)
+			{
+				slots.resize(kMaxEntities);
+				for (auto eid : world.getAll(PositionClass::cid))
+					added(eid, world.getComponent(PositionClass::cid, eid));
+				world.listen(PositionClass::cid, this);
+			}
+
+			virtual ~SpatialGrid()
+			{
+				world->unlisten(PositionClass::cid, this);
+			}
+
+			/// Return the number of entities in the grid.
+			unsigned size() const {return count;}
+
+			/// Re-read the position of one entity.
+			void move(Eid eid)
+			{
+				auto p = static_cast<PositionClass*>(world->getComponent(PositionClass::cid, eid));
+				if (p != nullptr)
+					place(eid, p->*x, p->*y);
+			}
+
+			/// Re-read the position of every entity, only touching the cells of those which moved.
+			void update()
+			{
+				auto& eids = world->getAll(PositionClass::cid);
+				auto ptrs = world->getComponents(PositionClass::cid);
+				for (size_t i = 0; i < eids.size(); ++i)
+				{
+					auto p = static_cast<PositionClass*>(ptrs[i]);
+					place(eids[i], p->*x, p->*y);
+				}
+			}
+
+			/// Return the Eids whose position is within the rectangle.
+			/// The returned vector is reused by the next query.
+			const std::vector<Eid>& queryRect(Scalar minX, Scalar minY, Scalar maxX, Scalar maxY)
+			{
+				results.clear();
+				visit(minX, minY, maxX, maxY, [&](const Entry& e)
+				{
+					if (e.x >= minX && e.x <= maxX && e.y >= minY && e.y <= maxY)
+						results.push_back(e.eid);
+				});
+				return results;
+			}
+
+			/// Return the Eids whose position is within `radius` of the point.
+			/// The returned vector is reused by the next query.
+			const std::vector<Eid>& queryRadius(Scalar px, Scalar py, Scalar radius)
+			{
+				results.clear();
+				auto r2 = radius * radius;
+				visit(px - radius, py - radius, px + radius, py + radius, [&](const Entry& e)
+				{
+					auto dx = e.x - px, dy = e.y - py;
+					if (dx * dx + dy * dy <= r2)
+						results.push_back(e.eid);
+				});
+				return results;
+			}
+
+			virtual void added(Eid eid, Component* c)
+			{
+				auto p = static_cast<PositionClass*>(c);
+				place(eid, p->*x, p->*y);
+			}
+
+			virtual void removed(Eid eid, Component* c)
+			{
+				auto& slot = slots[eid];
+				if (slot.cell == nullptr)
+					return;
+				erase(slot);
+				slot.cell = nullptr;
+				count--;
+			}
+
+			virtual void changed(Eid eid, Component* c)
+			{
+				added(eid, c);
+			}
+
+			virtual void cleared()
+			{
+				cells.clear();
+				slots.assign(kMaxEntities, Slot());
+				count = 0;
+			}
+
+		private:
+			struct Entry
+			{
+				Eid eid;
+				Scalar x, y;
+			};
+
+			struct Slot
+			{
+				std::vector<Entry>* cell;
+				uint64_t key;
+				unsigned index;
+			};
+
+			inline int32_t coord(Scalar v) const {return (int32_t)floor(v * invCellSize);}
+			static inline uint64_t key(int32_t cx, int32_t cy) {return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);}
+
+			/// Store or update an entity's position, moving it between cells only when needed.
+			/// (Cell vectors are never erased from the map, so pointers to them remain valid.)
+			void place(Eid eid, Scalar px, Scalar py)
+			{
+				auto& slot = slots[eid];
+				auto k = key(coord(px), coord(py));
+				if (slot.cell != nullptr)
+				{
+					if (slot.key == k)
+					{
+						auto& e = (*slot.cell)[slot.index];
+						e.x = px;
+						e.y = py;
+						return;
+					}
+					erase(slot);
+				}
+				else
+					count++;
+				auto& cell = cells[k];
+				slot.cell = &cell;
+				slot.key = k;
+				slot.index = (unsigned)cell.size();
+				cell.push_back(Entry{eid, px, py});
+			}
+
+			/// Remove an entry from its cell by moving the last entry into its place.
+			void erase(Slot& slot)
+			{
+				auto& cell = *slot.cell;
+				cell[slot.index] = cell.back();
+				slots[cell[slot.index].eid].index = slot.index;
+				cell.pop_back();
+			}
+
+			template<class F> void visit(Scalar minX, Scalar minY, Scalar maxX, Scalar maxY, F f) const
+			{
+				auto x0 = coord(minX), y0 = coord(minY), x1 = coord(maxX), y1 = coord(maxY);
+				for (auto cx = x0; cx <= x1; ++cx)
+				{
+					for (auto cy = y0; cy <= y1; ++cy)
+					{
+						auto it = cells.find(key(cx, cy));
+						if (it == cells.end())
+							continue;
+						for (auto& e : it->second)
+							f(e);
+					}
+				}
+			}
+
+			World* world;
+			Scalar cellSize, invCellSize;
+			Scalar PositionClass::*x;
+			Scalar PositionClass::*y;
+			unsigned count;
+			std::unordered_map<uint64_t, std::vector<Entry>> cells;
+			std::vector<Slot> slots;
+			std::vector<Eid> results;
+	};
 };
 
 ///
@@ -157,8 +1728,21 @@ class System
 	public:
 		struct Ent;
 	
+		/// Run the `tick` or `animate` of every registered system in registration order,
+		/// each timed by the profiler of the current world. A tick ends by publishing the world's telemetry, if any.
 		static void tick(double fixedDelta);
 		static void animate(double delta, double tickPercent);
+
+		/// Register a system by name. Either function may be null.
+		/// `cids` lists the component pools the system touches, for the profiler's per-pool counters.
+		static void add(const char* name, void (*tick)(double), void (*animate)(double, double) = nullptr,
+			const std::vector<Cid>& cids = std::vector<Cid>());
+
+		/// Register a system class which has a static `tick` and optionally a static `animate`.
+		template<class SystemClass> static void add(const char* name, const std::vector<Cid>& cids = std::vector<Cid>())
+		{
+			add(name, &SystemClass::tick, &SystemClass::animate, cids);
+		}
 };
 
 
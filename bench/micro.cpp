@@ -0,0 +1,193 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Micro-benchmarks of the core entity and component operations.
+/// Under the MIT license.
+///
+/// Build and run from the repository root with:
+/// make bench
+///
+/// Or by hand, optionally passing the largest entity count to run:
+/// g++ -std=c++11 -O2 -DNDEBUG -DEntityFu_MaxEntities=1048576 -I. bench/micro.cpp EntityFu.cpp -o micro
+/// ./micro 100000 > micro.json
+///
+/// Results are printed to stdout as a JSON array with one record per operation, entity count and number of
+/// component types, holding the median of several runs. Progress is printed to stderr.
+///
+
+#include "EntityFu.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/// One component class stands in for every type, since pools are only told apart by `Cid`.
+struct BlobComponent : Entity::Component
+{
+	float a, b, c, d;
+
+	BlobComponent(float x) : a(x), b(x), c(x), d(x) {}
+	BlobComponent() : BlobComponent(0) {}
+
+	virtual bool empty() const {return false;}
+
+	static Cid cid;
+};
+
+Cid BlobComponent::cid = 0;
+Cid Entity::Component::numCids = 256;
+
+/// Each entity gets this many components, spread round-robin over the component types.
+static const unsigned kPerEntity = 4;
+
+/// Each configuration is measured this many times and the median is reported.
+static const unsigned kRuns = 3;
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Timings of one run, in seconds, and the number of operations each timing covers.
+struct Result
+{
+	const char* op;
+	double seconds;
+	size_t ops;
+};
+
+static bool first = true;
+static volatile float sink;
+
+static void run(unsigned numEntities, unsigned numTypes, vector<Result>& out)
+{
+	auto perEntity = min(numTypes, kPerEntity);
+	vector<Eid> eids(numEntities);
+	mt19937 rng(numEntities + numTypes);
+	Entity::World world;
+
+	// alloc
+	auto start = now();
+	world.alloc();
+	out.push_back(Result{"alloc", now() - start, 1});
+
+	// create
+	start = now();
+	for (unsigned i = 0; i < numEntities; ++i)
+		eids[i] = world.create();
+	out.push_back(Result{"create", now() - start, numEntities});
+
+	// add
+	start = now();
+	for (unsigned i = 0; i < numEntities; ++i)
+		for (unsigned k = 0; k < perEntity; ++k)
+			world.addComponent((i + k) % numTypes, eids[i], new BlobComponent((float)i));
+	out.push_back(Result{"add", now() - start, (size_t)numEntities * perEntity});
+
+	// get, in random order
+	auto shuffled = eids;
+	shuffle(shuffled.begin(), shuffled.end(), rng);
+	float sum = 0;
+	start = now();
+	for (unsigned i = 0; i < numEntities; ++i)
+	{
+		auto eid = shuffled[i];
+		for (unsigned k = 0; k < perEntity; ++k)
+			sum += static_cast<BlobComponent*>(world.getComponent((eid - 1 + k) % numTypes, eid))->a;
+	}
+	out.push_back(Result{"get", now() - start, (size_t)numEntities * perEntity});
+
+	// iterate every pool
+	size_t visited = 0;
+	start = now();
+	for (Cid cid = 0; cid < numTypes; ++cid)
+	{
+		auto& all = world.getAll(cid);
+		auto components = world.getComponents(cid);
+		for (size_t i = 0; i < all.size(); ++i)
+			sum += static_cast<BlobComponent*>(components[i])->b;
+		visited += all.size();
+	}
+	out.push_back(Result{"getAll", now() - start, visited});
+
+	// remove the first component type from every entity which has it
+	auto& firstPool = world.getAll(0);
+	vector<Eid> holders(firstPool.begin(), firstPool.end());
+	shuffle(holders.begin(), holders.end(), rng);
+	start = now();
+	for (auto eid : holders)
+		world.removeComponent(0, eid);
+	out.push_back(Result{"remove", now() - start, holders.size()});
+
+	// destroy half the entities, in random order
+	auto half = numEntities / 2;
+	start = now();
+	for (unsigned i = 0; i < half; ++i)
+		world.destroyNow(shuffled[i]);
+	out.push_back(Result{"destroy", now() - start, half});
+
+	// destroy the rest
+	start = now();
+	world.destroyAll();
+	out.push_back(Result{"destroyAll", now() - start, numEntities - half});
+
+	// batch creation, then dealloc
+	start = now();
+	auto made = world.createMany(numEntities, eids.data());
+	out.push_back(Result{"createMany", now() - start, made});
+
+	start = now();
+	world.dealloc();
+	out.push_back(Result{"dealloc", now() - start, 1});
+
+	sink = sum;
+}
+
+static void report(unsigned numEntities, unsigned numTypes)
+{
+	vector<vector<Result>> runs(kRuns);
+	for (auto& results : runs)
+		run(numEntities, numTypes, results);
+
+	for (size_t r = 0; r < runs.front().size(); ++r)
+	{
+		vector<double> seconds;
+		for (auto& results : runs)
+			seconds.push_back(results[r].seconds);
+		sort(seconds.begin(), seconds.end());
+		auto& result = runs.front()[r];
+		auto median = seconds[seconds.size() / 2];
+
+		printf("%s\n  {\"op\": \"%s\", \"entities\": %u, \"types\": %u, \"ops\": %zu, \"ms\": %.3f, \"nsPerOp\": %.2f}",
+			first ? "" : ",", result.op, numEntities, numTypes, result.ops,
+			median * 1e3, result.ops > 0 ? median * 1e9 / result.ops : 0.0);
+		fprintf(stderr, "%8u entities %3u types %-10s %10.2f ns/op\n", numEntities, numTypes, result.op,
+			result.ops > 0 ? median * 1e9 / result.ops : 0.0);
+		first = false;
+	}
+}
+
+int main(int argc, const char * argv[])
+{
+	unsigned largest = argc > 1 ? (unsigned)atoi(argv[1]) : 1000000;
+	unsigned counts[] = {1000, 10000, 100000, 1000000};
+	unsigned types[] = {1, 4, 16, 64, 256};
+
+	printf("[");
+	for (auto n : counts)
+	{
+		if (n > largest)
+			continue;
+		if (n >= Entity::kMaxEntities)
+		{
+			fprintf(stderr, "%8u entities: skipped, compile with -DEntityFu_MaxEntities=%u or more\n", n, n + 1);
+			continue;
+		}
+		for (auto t : types)
+			report(n, t);
+	}
+	printf("\n]\n");
+	return 0;
+}
@@ -0,0 +1,445 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Scenario benchmarks modelled on game workloads, built from systems.
+/// Under the MIT license.
+///
+/// Build and run from the repository root with:
+/// make scenarios
+///
+/// Each scenario is warmed up to a steady state, then every tick is timed.
+/// Results are printed to stdout as a JSON array with the mean cost per entity per tick and the
+/// p50 and p99 frame times of each scenario, and the ECS heap allocations per tick. A table is printed to stderr.
+///
+
+#include "EntityFu.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+
+using namespace std;
+
+struct PositionComponent : Entity::Component
+{
+	float x, y;
+
+	PositionComponent(float _x, float _y) : x(_x), y(_y) {}
+	PositionComponent() : PositionComponent(0, 0) {}
+
+	virtual bool empty() const {return false;}
+
+	static Cid cid;
+};
+
+struct VelocityComponent : Entity::Component
+{
+	float x, y;
+
+	VelocityComponent(float _x, float _y) : x(_x), y(_y) {}
+	VelocityComponent() : VelocityComponent(0, 0) {}
+
+	virtual bool empty() const {return x == 0 && y == 0;}
+
+	static Cid cid;
+};
+
+struct LifetimeComponent : Entity::Component
+{
+	int ticks;
+
+	LifetimeComponent(int _ticks) : ticks(_ticks) {}
+	LifetimeComponent() : LifetimeComponent(0) {}
+
+	virtual bool empty() const {return ticks <= 0;}
+
+	static Cid cid;
+};
+
+struct HealthComponent : Entity::Component
+{
+	int hp, maxHP;
+
+	HealthComponent(int _hp, int _maxHP) : hp(_hp), maxHP(_maxHP) {}
+	HealthComponent() : HealthComponent(0, 0) {}
+
+	virtual bool empty() const {return maxHP == 0;}
+
+	static Cid cid;
+};
+
+/// Generic components for the mixed frame.
+template<unsigned N> struct MixComponent : Entity::Component
+{
+	float value[4];
+
+	MixComponent(float v) {for (auto& x : value) x = v;}
+	MixComponent() : MixComponent(0) {}
+
+	virtual bool empty() const {return false;}
+
+	static Cid cid;
+};
+
+static const unsigned kMixTypes = 8;
+
+Cid PositionComponent::cid = 0;
+Cid VelocityComponent::cid = 1;
+Cid LifetimeComponent::cid = 2;
+Cid HealthComponent::cid = 3;
+template<unsigned N> Cid MixComponent<N>::cid = 4 + N;
+Cid Entity::Component::numCids = 4 + kMixTypes;
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static mt19937 rng(1);
+
+static float uniform(float lo, float hi)
+{
+	return uniform_real_distribution<float>(lo, hi)(rng);
+}
+
+/// Side of the square which every moving entity stays inside.
+static float side = 1000.f;
+
+///
+/// Systems
+///
+
+/// Integrates velocity and bounces off the edges.
+struct MoveSystem : System
+{
+	static void tick(double fixedDelta)
+	{
+		auto& eids = Entity::getAll<PositionComponent>();
+		auto positions = Entity::getComponents<PositionComponent>();
+		auto dt = (float)fixedDelta;
+		for (size_t i = 0; i < eids.size(); ++i)
+		{
+			auto v = Entity::getPointer<VelocityComponent>(eids[i]);
+			if (v == nullptr)
+				continue;
+			auto& p = *static_cast<PositionComponent*>(positions[i]);
+			p.x += v->x * dt;
+			p.y += v->y * dt;
+			if (p.x < 0 || p.x > side) v->x = -v->x;
+			if (p.y < 0 || p.y > side) v->y = -v->y;
+		}
+	}
+};
+
+/// Counts down lifetimes and destroys expired entities after the loop.
+struct LifetimeSystem : System
+{
+	static vector<Eid> expired;
+
+	static void tick(double fixedDelta)
+	{
+		auto& eids = Entity::getAll<LifetimeComponent>();
+		auto lifetimes = Entity::getComponents<LifetimeComponent>();
+		expired.clear();
+		for (size_t i = 0; i < eids.size(); ++i)
+			if (--static_cast<LifetimeComponent*>(lifetimes[i])->ticks <= 0)
+				expired.push_back(eids[i]);
+		Entity::destroyMany(expired.data(), (unsigned)expired.size());
+	}
+};
+
+vector<Eid> LifetimeSystem::expired;
+
+/// Spawns a burst of particles each tick.
+struct EmitterSystem : System
+{
+	static unsigned rate, lifetime;
+	static vector<Eid> spawned;
+
+	static void tick(double fixedDelta)
+	{
+		spawned.resize(rate);
+		auto n = Entity::createMany(rate, spawned.data(),
+			PositionComponent(side / 2, side / 2), VelocityComponent(), LifetimeComponent(lifetime));
+		for (unsigned i = 0; i < n; ++i)
+		{
+			auto& v = Entity::get<VelocityComponent>(spawned[i]);
+			v.x = uniform(-50, 50);
+			v.y = uniform(-50, 50);
+		}
+	}
+};
+
+unsigned EmitterSystem::rate = 0;
+unsigned EmitterSystem::lifetime = 0;
+vector<Eid> EmitterSystem::spawned;
+
+/// Steers each boid by the neighbours within a radius.
+struct BoidSystem : System
+{
+	static Entity::SpatialGrid<PositionComponent>* grid;
+	static float radius;
+
+	static void tick(double fixedDelta)
+	{
+		grid->update();
+		auto& eids = Entity::getAll<PositionComponent>();
+		auto positions = Entity::getComponents<PositionComponent>();
+		for (size_t i = 0; i < eids.size(); ++i)
+		{
+			auto& p = *static_cast<PositionComponent*>(positions[i]);
+			auto& v = Entity::get<VelocityComponent>(eids[i]);
+			float cx = 0, cy = 0, ax = 0, ay = 0, sx = 0, sy = 0;
+			unsigned n = 0;
+			for (auto other : grid->queryRadius(p.x, p.y, radius))
+			{
+				if (other == eids[i])
+					continue;
+				auto& q = Entity::get<PositionComponent>(other);
+				auto& w = Entity::get<VelocityComponent>(other);
+				cx += q.x; cy += q.y;
+				ax += w.x; ay += w.y;
+				sx += p.x - q.x; sy += p.y - q.y;
+				++n;
+			}
+			if (n == 0)
+				continue;
+
+			// cohesion, alignment and separation
+			v.x += (cx / n - p.x) * 0.01f + (ax / n - v.x) * 0.05f + sx * 0.02f;
+			v.y += (cy / n - p.y) * 0.01f + (ay / n - v.y) * 0.05f + sy * 0.02f;
+			auto speed = sqrtf(v.x * v.x + v.y * v.y);
+			if (speed > 20.f)
+			{
+				v.x *= 20.f / speed;
+				v.y *= 20.f / speed;
+			}
+		}
+	}
+};
+
+Entity::SpatialGrid<PositionComponent>* BoidSystem::grid = nullptr;
+float BoidSystem::radius = 0;
+
+/// Deals random damage to a fraction of the entities with health.
+struct DamageSystem : System
+{
+	static unsigned hits;
+
+	static void tick(double fixedDelta)
+	{
+		auto& eids = Entity::getAll<HealthComponent>();
+		if (eids.empty())
+			return;
+		uniform_int_distribution<size_t> pick(0, eids.size() - 1);
+		for (unsigned i = 0; i < hits; ++i)
+			Entity::get<HealthComponent>(eids[pick(rng)]).hp -= 10;
+	}
+};
+
+unsigned DamageSystem::hits = 0;
+
+/// Regenerates health, destroys the dead and respawns them to keep the population constant.
+struct HealthSystem : System
+{
+	static vector<Eid> dead;
+
+	static void tick(double fixedDelta)
+	{
+		auto& eids = Entity::getAll<HealthComponent>();
+		auto healths = Entity::getComponents<HealthComponent>();
+		dead.clear();
+		for (size_t i = 0; i < eids.size(); ++i)
+		{
+			auto& health = *static_cast<HealthComponent*>(healths[i]);
+			if (health.hp <= 0)
+				dead.push_back(eids[i]);
+			else if (health.hp < health.maxHP)
+				health.hp++;
+		}
+		auto n = (unsigned)dead.size();
+		Entity::destroyMany(dead.data(), n);
+		Entity::createMany(n, dead.data(), HealthComponent(100, 100), PositionComponent());
+	}
+};
+
+vector<Eid> HealthSystem::dead;
+
+/// One of the systems of the mixed frame. Reads one component class and writes another
+/// on every entity which has both.
+template<unsigned N> struct MixSystem : System
+{
+	typedef MixComponent<N % kMixTypes> Read;
+	typedef MixComponent<(N * 3 + 1) % kMixTypes> Write;
+
+	static void tick(double fixedDelta)
+	{
+		auto& eids = Entity::getAll<Read>();
+		auto reads = Entity::getComponents<Read>();
+		for (size_t i = 0; i < eids.size(); ++i)
+		{
+			auto w = Entity::getPointer<Write>(eids[i]);
+			if (w == nullptr)
+				continue;
+			auto& r = *static_cast<Read*>(reads[i]);
+			for (unsigned k = 0; k < 4; ++k)
+				w->value[k] = w->value[k] * 0.5f + r.value[k] * (float)fixedDelta;
+		}
+	}
+};
+
+/// Ticks `MixSystem<0>` through `MixSystem<N - 1>` in order.
+template<unsigned N> struct MixFrame
+{
+	static void tick(double fixedDelta)
+	{
+		MixFrame<N - 1>::tick(fixedDelta);
+		MixSystem<N - 1>::tick(fixedDelta);
+	}
+};
+
+template<> struct MixFrame<0>
+{
+	static void tick(double fixedDelta) {}
+};
+
+/// Give an entity a component of class `MixComponent<N>` with the given probability.
+template<unsigned N> struct MixSpawn
+{
+	static void add(Eid eid, float chance)
+	{
+		MixSpawn<N - 1>::add(eid, chance);
+		if (uniform(0, 1) < chance)
+			Entity::addComponent(eid, new MixComponent<N - 1>(uniform(0, 1)));
+	}
+};
+
+template<> struct MixSpawn<0>
+{
+	static void add(Eid eid, float chance) {}
+};
+
+///
+/// Scenarios
+///
+
+static const unsigned kWarmupTicks = 50, kTicks = 200;
+static const double kFixedDelta = 1.0 / 60;
+static bool first = true;
+
+/// Run a frame function, time every tick after the warmup and print the results.
+template<class F> static void measure(const char* name, F frame)
+{
+	for (unsigned t = 0; t < kWarmupTicks; ++t)
+		frame();
+
+	vector<double> times;
+	double entityTicks = 0, total = 0;
+	auto allocations = Entity::allocations();
+	for (unsigned t = 0; t < kTicks; ++t)
+	{
+		auto start = now();
+		frame();
+		auto elapsed = now() - start;
+		times.push_back(elapsed);
+		total += elapsed;
+		entityTicks += Entity::count();
+	}
+	auto allocationsPerTick = (double)(Entity::allocations() - allocations) / kTicks;
+	sort(times.begin(), times.end());
+	auto p50 = times[times.size() / 2];
+	auto p99 = times[min(times.size() - 1, times.size() * 99 / 100)];
+	auto entities = entityTicks / kTicks;
+	auto nsPerEntity = total * 1e9 / entityTicks;
+
+	printf("%s\n  {\"scenario\": \"%s\", \"entities\": %.0f, \"ticks\": %u, \"nsPerEntityTick\": %.2f, \"p50Ms\": %.3f, \"p99Ms\": %.3f, \"allocationsPerTick\": %.1f}",
+		first ? "" : ",", name, entities, kTicks, nsPerEntity, p50 * 1e3, p99 * 1e3, allocationsPerTick);
+	fprintf(stderr, "%-10s %8.0f entities: %7.2f ns/entity/tick, p50 %7.3f ms, p99 %7.3f ms, %8.1f allocations/tick\n",
+		name, entities, nsPerEntity, p50 * 1e3, p99 * 1e3, allocationsPerTick);
+	first = false;
+}
+
+/// Heavy spawn and despawn churn: a steady state of about 100k short-lived particles.
+static void particles(const char* name)
+{
+	EmitterSystem::rate = 1000;
+	EmitterSystem::lifetime = 100;
+	measure(name, []()
+	{
+		EmitterSystem::tick(kFixedDelta);
+		MoveSystem::tick(kFixedDelta);
+		LifetimeSystem::tick(kFixedDelta);
+	});
+	Entity::dealloc();
+}
+
+/// Flocking with a neighbour query per boid.
+static void boids()
+{
+	const unsigned kBoids = 20000;
+	side = sqrtf((float)kBoids) * 10.f;
+	for (unsigned i = 0; i < kBoids; ++i)
+		Entity::create(new PositionComponent(uniform(0, side), uniform(0, side)),
+			new VelocityComponent(uniform(-10, 10), uniform(-10, 10)));
+	{
+		Entity::SpatialGrid<PositionComponent> grid(20.f, &PositionComponent::x, &PositionComponent::y);
+		BoidSystem::grid = &grid;
+		BoidSystem::radius = 10.f;
+		measure("boids", []()
+		{
+			BoidSystem::tick(kFixedDelta);
+			MoveSystem::tick(kFixedDelta);
+		});
+		BoidSystem::grid = nullptr;
+	}
+	Entity::dealloc();
+	side = 1000.f;
+}
+
+/// A damage and death loop over 100k entities, respawning the dead.
+static void health()
+{
+	vector<Eid> eids(100000);
+	Entity::createMany((unsigned)eids.size(), eids.data(), HealthComponent(100, 100), PositionComponent());
+	DamageSystem::hits = 20000;
+	measure("health", []()
+	{
+		DamageSystem::tick(kFixedDelta);
+		HealthSystem::tick(kFixedDelta);
+	});
+	Entity::dealloc();
+}
+
+/// Thirty small systems over 50k entities with a random mix of eight component classes.
+static void mixed()
+{
+	for (unsigned i = 0; i < 50000; ++i)
+		MixSpawn<kMixTypes>::add(Entity::create(), 0.5f);
+	measure("mixed", []()
+	{
+		MixFrame<30>::tick(kFixedDelta);
+	});
+	Entity::dealloc();
+}
+
+int main(int argc, const char * argv[])
+{
+	// batch creation clones prototypes through their descriptions
+	Entity::describe<PositionComponent>();
+	Entity::describe<VelocityComponent>();
+	Entity::describe<LifetimeComponent>();
+	Entity::describe<HealthComponent>();
+
+	printf("[");
+	particles("particles");
+
+	// the same churn with component memory recycled through pools
+	Entity::useComponentPools();
+	particles("pooled");
+	Entity::useComponentPools(false);
+
+	boids();
+	health();
+	mixed();
+	printf("\n]\n");
+	return 0;
+}
@@ -0,0 +1,119 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Benchmark for `Entity::SpatialGrid` with moving entities.
+/// Under the MIT license.
+///
+/// Build from the repository root with:
+/// g++ -std=c++11 -O2 -DNDEBUG -DEntityFu_MaxEntities=1048576 -I. bench/spatial.cpp EntityFu.cpp -o spatial
+///
+
+#include "EntityFu.h"
+#include <chrono>
+#include <random>
+#include <stdio.h>
+
+using namespace std;
+
+struct PositionComponent : Entity::Component
+{
+	float x, y;
+
+	PositionComponent(float _x, float _y) : x(_x), y(_y) {}
+	PositionComponent() : PositionComponent(0, 0) {}
+
+	virtual bool empty() const {return false;}
+
+	static Cid cid;
+};
+
+struct VelocityComponent : Entity::Component
+{
+	float x, y;
+
+	VelocityComponent(float _x, float _y) : x(_x), y(_y) {}
+	VelocityComponent() : VelocityComponent(0, 0) {}
+
+	virtual bool empty() const {return x == 0 && y == 0;}
+
+	static Cid cid;
+};
+
+static Cid _id = 0;
+Cid PositionComponent::cid = _id++;
+Cid VelocityComponent::cid = _id++;
+Cid Entity::Component::numCids = _id;
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void run(unsigned numEntities)
+{
+	const unsigned kTicks = 10, kQueries = 1000;
+	const float kRadius = 8.f, kSpeed = 2.f;
+
+	// constant density of one entity per 100 square units
+	auto side = sqrt((float)numEntities) * 10.f;
+	mt19937 rng(numEntities);
+	uniform_real_distribution<float> pos(0, side), vel(-kSpeed, kSpeed);
+
+	for (unsigned i = 0; i < numEntities; ++i)
+		Entity::create(new PositionComponent(pos(rng), pos(rng)), new VelocityComponent(vel(rng), vel(rng)));
+
+	auto start = now();
+	{
+		Entity::SpatialGrid<PositionComponent> grid(kRadius * 2, &PositionComponent::x, &PositionComponent::y);
+		auto build = now() - start;
+
+		double moveTime = 0, updateTime = 0, queryTime = 0;
+		size_t found = 0;
+		for (unsigned tick = 0; tick < kTicks; ++tick)
+		{
+			// integrate
+			start = now();
+			auto& eids = Entity::getAll<PositionComponent>();
+			auto positions = Entity::getComponents<PositionComponent>();
+			for (size_t i = 0; i < eids.size(); ++i)
+			{
+				auto& p = *static_cast<PositionComponent*>(positions[i]);
+				auto& v = Entity::get<VelocityComponent>(eids[i]);
+				p.x += v.x;
+				p.y += v.y;
+				if (p.x < 0 || p.x > side) v.x = -v.x;
+				if (p.y < 0 || p.y > side) v.y = -v.y;
+			}
+			moveTime += now() - start;
+
+			// re-index
+			start = now();
+			grid.update();
+			updateTime += now() - start;
+
+			// query
+			start = now();
+			for (unsigned q = 0; q < kQueries; ++q)
+				found += grid.queryRadius(pos(rng), pos(rng), kRadius).size();
+			queryTime += now() - start;
+		}
+
+		printf("%8u entities: build %8.2f ms, move %7.2f ms/tick, update %7.2f ms/tick, query %6.3f us (%.1f hits)\n",
+			numEntities, build * 1e3, moveTime * 1e3 / kTicks, updateTime * 1e3 / kTicks,
+			queryTime * 1e6 / (kTicks * kQueries), (double)found / (kTicks * kQueries));
+	}
+
+	Entity::dealloc();
+}
+
+int main(int argc, const char * argv[])
+{
+	unsigned counts[] = {10000, 100000, 1000000};
+	for (auto n : counts)
+	{
+		if (n < Entity::kMaxEntities)
+			run(n);
+		else
+			printf("%8u entities: skipped, compile with -DEntityFu_MaxEntities=%u or more\n", n, n + 1);
+	}
+	return 0;
+}
@@ -58,15 +58,14 @@ struct HealthSystem : System
 {
 	static void tick(double fixedDelta)
 	{
-		// create a copy of the vector<Eid> for all health components so we
-		// don't cause an assertion failure: "vector iterator not incrementable"
-		// for more speed you can instead loop over a reference as long as you schedule
-		// Entity::destroyNow for after the loop
-		auto all = Entity::getAll<HealthComponent>();
+		// loop over a reference rather than a copy, so the tick doesn't allocate
+		// walk backwards so Entity::destroyNow only moves entities which were already visited
+		auto& all = Entity::getAll<HealthComponent>();
 
 		// for this example, just decrement all health components each tick
-		for (auto eid : all)
+		for (auto i = all.size(); i-- > 0; )
 		{
+			auto eid = all[i];
 			Ent e(eid);
 			
 			// this is overly pragmatic, but you get the drift of how to check if a component is valid
@@ -0,0 +1,308 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Checks of the guarantees which games build on.
+/// Under the MIT license.
+///
+/// Build and run from the repository root with:
+/// make check
+///
+/// A pooled steady-state tick must not allocate, and saving, diffing, applying and rolling back must
+/// reproduce the world exactly, while deltas and snapshots with broken parent links are rejected.
+/// Failures print the line and abort, in release builds as well as debug ones.
+///
+
+#include "EntityFu.h"
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+#define Check(condition) \
+	do { if (!(condition)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); abort(); } } while (0)
+
+struct PositionComponent : Entity::Component
+{
+	float x, y;
+
+	PositionComponent(float _x, float _y) : x(_x), y(_y) {}
+	PositionComponent() : PositionComponent(0, 0) {}
+
+	virtual bool empty() const {return false;}
+
+	static Cid cid;
+};
+
+struct VelocityComponent : Entity::Component
+{
+	float x, y;
+
+	VelocityComponent(float _x, float _y) : x(_x), y(_y) {}
+	VelocityComponent() : VelocityComponent(0, 0) {}
+
+	virtual bool empty() const {return x == 0 && y == 0;}
+
+	static Cid cid;
+};
+
+struct LifetimeComponent : Entity::Component
+{
+	int ticks;
+
+	LifetimeComponent(int _ticks) : ticks(_ticks) {}
+	LifetimeComponent() : LifetimeComponent(0) {}
+
+	virtual bool empty() const {return ticks <= 0;}
+
+	static Cid cid;
+};
+
+Cid PositionComponent::cid = 0;
+Cid VelocityComponent::cid = 1;
+Cid LifetimeComponent::cid = 2;
+Cid Entity::Component::numCids = 3;
+
+static mt19937 rng(1);
+
+static unsigned below(unsigned n)
+{
+	return uniform_int_distribution<unsigned>(0, n - 1)(rng);
+}
+
+///
+/// Steady state
+///
+
+/// Spawn a burst of particles, move them and destroy the expired ones, as a particle system does every tick.
+static void particleTick(vector<Eid>& spawned, vector<Eid>& expired)
+{
+	auto n = Entity::createMany((unsigned)spawned.size(), spawned.data(),
+		PositionComponent(), VelocityComponent(1, 1), LifetimeComponent(40));
+	for (unsigned i = 0; i < n; ++i)
+		Entity::get<VelocityComponent>(spawned[i]).x = (float)below(100);
+
+	auto& eids = Entity::getAll<LifetimeComponent>();
+	auto lifetimes = Entity::getComponents<LifetimeComponent>();
+	expired.clear();
+	for (size_t i = 0; i < eids.size(); ++i)
+	{
+		auto& p = Entity::get<PositionComponent>(eids[i]);
+		auto& v = Entity::get<VelocityComponent>(eids[i]);
+		p.x += v.x;
+		p.y += v.y;
+		if (--static_cast<LifetimeComponent*>(lifetimes[i])->ticks <= 0)
+			expired.push_back(eids[i]);
+	}
+	Entity::destroyMany(expired.data(), (unsigned)expired.size());
+}
+
+/// Once pools and tables have grown to fit, a tick of churn makes no allocations.
+static void checkSteadyState()
+{
+	Entity::useComponentPools();
+	vector<Eid> spawned(50), expired;
+	expired.reserve(spawned.size());
+	for (unsigned t = 0; t < 100; ++t)
+		particleTick(spawned, expired);
+	{
+		Entity::NoAllocations region("pooled tick");
+		for (unsigned t = 0; t < 100; ++t)
+			particleTick(spawned, expired);
+	}
+	Check(Entity::count() > 0);
+	Entity::dealloc();
+	Entity::useComponentPools(false);
+}
+
+///
+/// Round trips
+///
+
+/// Create, destroy, reparent and modify entities at random, reporting every in-place write.
+static void mutate(unsigned steps)
+{
+	for (unsigned i = 0; i < steps; ++i)
+	{
+		Eid eid = 1 + below(200);
+		if (!Entity::exists(eid))
+		{
+			Entity::create(new PositionComponent((float)below(100), 0));
+			continue;
+		}
+		switch (below(6))
+		{
+			case 0:
+				Entity::addComponent(eid, new VelocityComponent((float)below(10) + 1, 1));
+				break;
+			case 1:
+				Entity::removeComponent<VelocityComponent>(eid);
+				break;
+			case 2:
+				if (below(4) == 0)
+					Entity::destroyNow(eid);
+				break;
+			case 3:
+			{
+				Eid parent = below(200);
+				if (parent != 0 && !Entity::exists(parent))
+					break;
+				auto cycle = false;
+				for (auto p = parent; p != 0; p = Entity::getParent(p))
+					cycle = cycle || p == eid;
+				if (!cycle)
+					Entity::setParent(eid, parent);
+				break;
+			}
+			default:
+				if (auto p = Entity::getPointer<PositionComponent>(eid))
+				{
+					p->y += 1;
+					Entity::changed<PositionComponent>(eid);
+				}
+		}
+	}
+}
+
+/// Return true if a world has the same entities, parents and plain components as the current one.
+static bool sameAsCurrent(Entity::World& world)
+{
+	if (world.worldHash() != Entity::worldHash())
+		return false;
+	for (Eid eid = 1; eid < Entity::kMaxEntities; ++eid)
+		if (world.exists(eid) && world.getParent(eid) != Entity::getParent(eid))
+			return false;
+	return true;
+}
+
+/// A delta from a snapshot applied to a copy of that snapshot reproduces the world.
+static void checkDiffApply()
+{
+	mutate(2000);
+	for (unsigned round = 0; round < 20; ++round)
+	{
+		vector<char> saved, delta;
+		Entity::save(saved);
+		Entity::Snapshot from;
+		Check(from.open(saved.data(), saved.size()));
+
+		mutate(200);
+		Entity::diff(from, delta);
+
+		Entity::World replica;
+		Check(replica.load(from));
+		Check(replica.apply(delta.data(), delta.size()));
+		Check(sameAsCurrent(replica));
+	}
+	Entity::dealloc();
+}
+
+/// Restoring any recorded tick brings back the world saved at that tick, though not necessarily in the same `getAll` order.
+static void checkHistory()
+{
+	Entity::History history(8);
+	vector<char> saved[40];
+	for (unsigned step = 0, tick = 0; step < 40; ++step, ++tick)
+	{
+		mutate(100);
+		history.save(tick);
+		Entity::save(saved[tick]);
+
+		if (step % 10 == 9)
+		{
+			auto back = tick - 1 - below(7);
+			Check(history.restore(back));
+			Check(!history.has(tick));
+			Entity::World expected;
+			Check(expected.load(saved[back].data(), saved[back].size()));
+			Check(sameAsCurrent(expected));
+			tick = back;
+		}
+	}
+	Check(!history.has(0));
+	Entity::dealloc();
+}
+
+///
+/// Rejections
+///
+
+/// A delta which would link to a dead entity or make a cycle fails to apply.
+static void checkBadDeltas()
+{
+	Entity::World world;
+	auto a = world.create(), b = world.create();
+	vector<char> saved, delta;
+	world.save(saved);
+	Entity::Snapshot from;
+	Check(from.open(saved.data(), saved.size()));
+	world.setParent(b, a);
+	world.diff(from, delta);
+
+	// the parent is gone
+	Entity::World dead;
+	Check(dead.load(from));
+	dead.destroyNow(a);
+	Check(!dead.apply(delta.data(), delta.size()));
+	Check(dead.getParent(b) == 0);
+
+	// the parent is already a child of the entity
+	Entity::World cyclic;
+	Check(cyclic.load(from));
+	cyclic.setParent(a, b);
+	Check(!cyclic.apply(delta.data(), delta.size()));
+	Check(cyclic.getParent(b) == 0 && cyclic.getParent(a) == b);
+
+	Entity::World good;
+	Check(good.load(from));
+	Check(good.apply(delta.data(), delta.size()));
+	Check(good.getParent(b) == a);
+}
+
+/// A snapshot whose parent links are not trees of live entities fails to open and to load.
+static void checkBadSnapshots()
+{
+	Entity::World world;
+	auto a = world.create(), b = world.create(), c = world.create();
+	world.setParent(b, a);
+	vector<char> saved;
+	world.save(saved);
+	Entity::Snapshot snapshot;
+	Check(snapshot.open(saved.data(), saved.size()));
+	auto parents = const_cast<Eid*>(snapshot.parents);
+
+	parents[a] = b;
+	Check(!snapshot.open(saved.data(), saved.size()));
+	Entity::World loaded;
+	Check(!loaded.load(saved.data(), saved.size()));
+
+	parents[a] = 0;
+	parents[c] = c;
+	Check(!snapshot.open(saved.data(), saved.size()));
+
+	parents[c] = Entity::kMaxEntities - 1;
+	Check(!snapshot.open(saved.data(), saved.size()));
+
+	parents[c] = 0;
+	parents[Entity::kMaxEntities - 1] = a;
+	Check(!snapshot.open(saved.data(), saved.size()));
+
+	parents[Entity::kMaxEntities - 1] = 0;
+	Check(snapshot.open(saved.data(), saved.size()));
+	Check(loaded.load(snapshot) && loaded.getParent(b) == a);
+}
+
+int main(int argc, const char * argv[])
+{
+	// plain components are saved, diffed and rolled back; every class is cloned by createMany
+	Entity::describe<PositionComponent>(true);
+	Entity::describe<VelocityComponent>(true);
+	Entity::describe<LifetimeComponent>(true);
+
+	checkSteadyState();
+	checkDiffApply();
+	checkHistory();
+	checkBadDeltas();
+	checkBadSnapshots();
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,217 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Replays a trace recorded by `Entity::Recorder` and reports timings.
+/// Under the MIT license.
+///
+/// Build from the repository root with:
+/// make replay
+///
+/// Usage: replay trace.bin [repeats]
+///
+/// Every recorded component becomes a blob of the recorded size, so any trace can be replayed
+/// without the game's component classes. The trace is decoded into memory first, then replayed
+/// `repeats` times into a fresh world. Runs of consecutive calls of the same kind are timed together,
+/// which keeps the clock out of the per-call cost. Results are printed to stdout as JSON, with a table on stderr.
+///
+
+#include "EntityFu.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+/// A component of any size.
+struct BlobComponent : Entity::Component
+{
+	/// Allocate room for `bytes` bytes of component, which may be more than the class itself.
+	struct Bytes {unsigned n;};
+
+	static void* operator new(size_t size, Bytes bytes) {return Entity::Component::operator new(max(size, (size_t)bytes.n));}
+	static void operator delete(void* p, Bytes) {Entity::Component::operator delete(p);}
+	static void operator delete(void* p) {Entity::Component::operator delete(p);}
+
+	virtual bool empty() const {return false;}
+};
+
+/// The number of component classes is read from the trace.
+Cid Entity::Component::numCids = 0;
+
+static const char* names[] = {"create", "destroy", "add", "remove", "get", "getAll", "getComponents"};
+static const unsigned kOps = sizeof(names) / sizeof(names[0]);
+
+struct Call
+{
+	unsigned op;
+	Cid cid;
+	Eid eid;
+	unsigned size;
+};
+
+static volatile size_t sink;
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool varint(const unsigned char*& p, const unsigned char* end, uint64_t& v)
+{
+	v = 0;
+	for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+	{
+		auto byte = *p++;
+		v |= uint64_t(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+static bool decode(const char* path, vector<Call>& calls)
+{
+	auto file = fopen(path, "rb");
+	if (file == nullptr)
+		return false;
+	vector<unsigned char> data;
+	unsigned char chunk[65536];
+	for (size_t n; (n = fread(chunk, 1, sizeof(chunk), file)) > 0; )
+		data.insert(data.end(), chunk, chunk + n);
+	fclose(file);
+
+	uint32_t header[4];
+	if (data.size() < sizeof(header))
+		return false;
+	memcpy(header, data.data(), sizeof(header));
+	if (header[0] != 0x43524645 || header[1] != Entity::Recorder::kVersion)
+		return false;
+	if (header[2] > Entity::kMaxEntities)
+	{
+		fprintf(stderr, "Trace needs %u entities, compile with -DEntityFu_MaxEntities=%u or more\n", header[2], header[2]);
+		return false;
+	}
+	Entity::Component::numCids = header[3];
+
+	const unsigned char* p = data.data() + sizeof(header);
+	auto end = data.data() + data.size();
+	while (p < end)
+	{
+		Call call = {*p++, 0, 0, 0};
+		uint64_t v = 0;
+		if (call.op >= kOps)
+			return false;
+		if (call.op != Entity::Recorder::Create && call.op != Entity::Recorder::Destroy)
+		{
+			if (!varint(p, end, v))
+				return false;
+			call.cid = (Cid)v;
+		}
+		if (call.op != Entity::Recorder::GetAll && call.op != Entity::Recorder::GetComponents)
+		{
+			if (!varint(p, end, v))
+				return false;
+			call.eid = (Eid)v;
+		}
+		if (call.op == Entity::Recorder::Add)
+		{
+			if (!varint(p, end, v))
+				return false;
+			call.size = (unsigned)v;
+		}
+		calls.push_back(call);
+	}
+	return true;
+}
+
+/// Replay every call into a fresh world, adding the time of each run of same-kind calls to `seconds`.
+static void replay(const vector<Call>& calls, double seconds[kOps])
+{
+	// recorded Eids are mapped to the Eids the replay creates
+	vector<Eid> eids(Entity::kMaxEntities, 0);
+	size_t sum = 0;
+	Entity::World world;
+	world.alloc();
+
+	for (size_t i = 0; i < calls.size(); )
+	{
+		auto op = calls[i].op;
+		auto start = now();
+		for (; i < calls.size() && calls[i].op == op; ++i)
+		{
+			auto& call = calls[i];
+			auto eid = call.eid < Entity::kMaxEntities ? eids[call.eid] : 0;
+			switch (op)
+			{
+				case Entity::Recorder::Create:
+					if (call.eid < Entity::kMaxEntities)
+						eids[call.eid] = world.create();
+					break;
+				case Entity::Recorder::Destroy:
+					if (world.exists(eid))
+						world.destroyNow(eid);
+					break;
+				case Entity::Recorder::Add:
+					if (world.exists(eid))
+						world.addComponent(call.cid, eid, new (BlobComponent::Bytes{call.size}) BlobComponent);
+					break;
+				case Entity::Recorder::Remove:
+					if (world.exists(eid))
+						world.removeComponent(call.cid, eid);
+					break;
+				case Entity::Recorder::Get:
+					sum += (size_t)world.getComponent(call.cid, eid);
+					break;
+				case Entity::Recorder::GetAll:
+					sum += world.getAll(call.cid).size();
+					break;
+				case Entity::Recorder::GetComponents:
+					sum += (size_t)world.getComponents(call.cid);
+					break;
+			}
+		}
+		seconds[op] += now() - start;
+	}
+
+	sink = sum;
+}
+
+int main(int argc, const char * argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s trace.bin [repeats]\n", argv[0]);
+		return 1;
+	}
+	unsigned repeats = argc > 2 ? max(1, atoi(argv[2])) : 1;
+
+	vector<Call> calls;
+	if (!decode(argv[1], calls))
+	{
+		fprintf(stderr, "Could not read trace %s\n", argv[1]);
+		return 1;
+	}
+
+	size_t counts[kOps] = {};
+	for (auto& call : calls)
+		counts[call.op]++;
+
+	double seconds[kOps] = {}, total = 0;
+	for (unsigned r = 0; r < repeats; ++r)
+		replay(calls, seconds);
+	for (unsigned op = 0; op < kOps; ++op)
+		total += seconds[op];
+
+	printf("{\"trace\": \"%s\", \"calls\": %zu, \"repeats\": %u, \"ms\": %.3f, \"ops\": [", argv[1], calls.size(), repeats, total * 1e3 / repeats);
+	for (unsigned op = 0; op < kOps; ++op)
+	{
+		auto ms = seconds[op] * 1e3 / repeats;
+		auto ns = counts[op] > 0 ? seconds[op] * 1e9 / (repeats * counts[op]) : 0.0;
+		printf("%s\n  {\"op\": \"%s\", \"calls\": %zu, \"ms\": %.3f, \"nsPerCall\": %.2f}", op > 0 ? "," : "", names[op], counts[op], ms, ns);
+		fprintf(stderr, "%-14s %10zu calls %10.3f ms %8.2f ns/call\n", names[op], counts[op], ms, ns);
+	}
+	printf("\n]}\n");
+	fprintf(stderr, "%-14s %10zu calls %10.3f ms\n", "total", calls.size(), total * 1e3 / repeats);
+	return 0;
+}
@@ -0,0 +1,95 @@
+///
+/// [EntityFu](https://github.com/NatWeiss/EntityFu)
+/// Shows the telemetry page published by a running `Entity::Telemetry`.
+/// Under the MIT license.
+///
+/// Build from the repository root with:
+/// make telemetry
+///
+/// Usage: telemetry [name] [interval ms]
+///
+/// The name defaults to "/entityfu". The page is redrawn every interval until the publishing
+/// process removes it. An interval of 0 prints the page once.
+///
+
+#include "EntityFu.h"
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+/// The number of component classes is read from the page.
+Cid Entity::Component::numCids = 0;
+
+static void show(const Entity::TelemetryPage& page, const char* name)
+{
+	printf("%s  tick %llu  entities %u  memory %.1f MB\n\n", name, (unsigned long long)page.tick,
+		page.entities, page.memoryBytes / (1024.0 * 1024.0));
+
+	// never trust counts read from shared memory
+	auto numCids = min(page.numCids, (uint32_t)Entity::TelemetryPage::kMaxCids);
+	auto numSystems = min(page.numSystems, (uint32_t)Entity::TelemetryPage::kMaxSystems);
+
+	printf("%-6s %10s\n", "cid", "count");
+	for (unsigned cid = 0; cid < numCids; ++cid)
+		if (page.populations[cid] > 0)
+			printf("%-6u %10u\n", cid, page.populations[cid]);
+
+	if (numSystems > 0)
+	{
+		printf("\n%-32s %10s %10s %10s %10s %10s\n", "system", "calls", "entities", "last ms", "p50 ms", "p99 ms");
+		for (unsigned i = 0; i < numSystems; ++i)
+		{
+			auto& system = page.systems[i];
+			printf("%-32s %10u %10u %10.3f %10.3f %10.3f\n", system.name, system.calls, system.entities,
+				system.last * 1e3, system.p50 * 1e3, system.p99 * 1e3);
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, const char * argv[])
+{
+	auto name = argc > 1 ? argv[1] : "/entityfu";
+	auto interval = argc > 2 ? atoi(argv[2]) : 500;
+
+	auto shared = Entity::Telemetry::open(name);
+	if (shared == nullptr)
+	{
+		fprintf(stderr, "No telemetry published as %s\n", name);
+		return 1;
+	}
+
+	// the page is large, so keep the copy off the stack
+	auto page = new Entity::TelemetryPage;
+	for (;;)
+	{
+		if (!Entity::TelemetryPage::read(shared, *page))
+		{
+			fprintf(stderr, "Telemetry %s has an unknown version or is stuck mid-update\n", name);
+			break;
+		}
+		if (interval > 0)
+			printf("\033[H\033[2J");
+		show(*page, name);
+		if (interval <= 0)
+			break;
+		this_thread::sleep_for(chrono::milliseconds(interval));
+
+		// stop once the publisher has removed the segment
+		auto check = Entity::Telemetry::open(name);
+		if (check == nullptr)
+		{
+			printf("\n%s was removed\n", name);
+			break;
+		}
+		Entity::Telemetry::close(check);
+	}
+
+	delete page;
+	Entity::Telemetry::close(shared);
+	return 0;
+}